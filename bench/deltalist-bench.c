@@ -0,0 +1,173 @@
+/* This file is part of psnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * psnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * psnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Compares the generic delta_list operations, which call hash() and equals()
+ * through function pointers, with those generated by DEFINE_DELTA_LIST(), on
+ * the two kinds of key the daemons use: client addresses and message IDs.
+ *
+ * usage: deltalist-bench [keys [operations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "deltalist.h"
+#include "ipv6.h"
+
+#define ID_SIZE 64
+
+struct msg_id {
+	char id[ID_SIZE];
+};
+
+static unsigned long addr_hash(const void *data)
+{
+	const struct sockaddr_in *a = data;
+
+	return a->sin_addr.s_addr + a->sin_port;
+}
+
+static int addr_equals(const void *a, const void *b)
+{
+	return sockaddr_equals(a, b);
+}
+
+static unsigned long id_hash(const void *data)
+{
+	const char *s = data;
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *s++))
+		hash = ((hash << 5) + hash) + c;
+	return hash;
+}
+
+static int id_equals(const void *a, const void *b)
+{
+	return !strcmp(a, b);
+}
+
+static void act(const void *data)
+{
+}
+
+DEFINE_DELTA_LIST(addr_delta, struct sockaddr_storage, addr_hash, addr_equals)
+DEFINE_DELTA_LIST(id_delta, struct msg_id, id_hash, id_equals)
+
+static struct delta_list addr_table = {
+	.timeout_ms = 3600000,
+	.key_size = sizeof(struct sockaddr_storage),
+	.hash = addr_hash,
+	.equals = addr_equals,
+	.act = act
+};
+
+static struct delta_list id_table = {
+	.timeout_ms = 3600000,
+	.key_size = sizeof(struct msg_id),
+	.hash = id_hash,
+	.equals = id_equals,
+	.act = act
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* visits the keys in a scattered order, so that lookups miss the cache */
+#define KEY(i) (((i) * 7919UL) % nr_keys)
+
+#define BENCH(label, op, keys)						\
+do {									\
+	double start = now();						\
+	for (unsigned long i = 0; i < nr_ops; i++)			\
+		hits += op(&keys[KEY(i)]);				\
+	printf("%-24s %8.1f ns\n", label,				\
+			(now() - start) * 1e9 / nr_ops);		\
+} while (0)
+
+#define generic_addr_contains(k) delta_contains(&addr_table, k)
+#define special_addr_contains(k) addr_delta_contains(&addr_table, k)
+#define generic_addr_update(k)   delta_update(&addr_table, k)
+#define special_addr_update(k)   addr_delta_update(&addr_table, k)
+#define generic_id_contains(k)   delta_contains(&id_table, k)
+#define special_id_contains(k)   id_delta_contains(&id_table, k)
+#define generic_id_update(k)     delta_update(&id_table, k)
+#define special_id_update(k)     id_delta_update(&id_table, k)
+
+int main(int argc, char *argv[])
+{
+	unsigned long nr_keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 50000;
+	unsigned long nr_ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+	struct sockaddr_storage *addrs;
+	struct msg_id *ids;
+	unsigned long hits = 0;
+
+	if (!nr_keys || !nr_ops) {
+		fprintf(stderr, "usage: %s [keys [operations]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	addrs = calloc(nr_keys, sizeof(*addrs));
+	ids = calloc(nr_keys, sizeof(*ids));
+	if (!addrs || !ids) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned long i = 0; i < nr_keys; i++) {
+		struct sockaddr_in *a = (struct sockaddr_in*) &addrs[i];
+		a->sin_family = AF_INET;
+		a->sin_addr.s_addr = htonl(0x0a000000 + i / 16);
+		a->sin_port = htons(1024 + i % 16);
+		snprintf(ids[i].id, ID_SIZE, "%016lx-%08lx-message",
+				i * 2654435761UL, i);
+	}
+
+	delta_init(&addr_table);
+	delta_init(&id_table);
+	for (unsigned long i = 0; i < nr_keys; i++) {
+		delta_update(&addr_table, &addrs[i]);
+		delta_update(&id_table, &ids[i]);
+	}
+
+	printf("%lu keys, %lu operations\n", nr_keys, nr_ops);
+	BENCH("address contains generic", generic_addr_contains, addrs);
+	BENCH("address contains special", special_addr_contains, addrs);
+	BENCH("address update generic", generic_addr_update, addrs);
+	BENCH("address update special", special_addr_update, addrs);
+	BENCH("ID contains generic", generic_id_contains, ids);
+	BENCH("ID contains special", special_id_contains, ids);
+	BENCH("ID update generic", generic_id_update, ids);
+	BENCH("ID update special", special_id_update, ids);
+
+	/* every key is present, so every operation should have hit */
+	if (hits != 8 * nr_ops) {
+		fprintf(stderr, "only %lu of %lu operations hit\n", hits,
+				8 * nr_ops);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
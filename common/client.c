@@ -18,7 +18,9 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -34,16 +36,12 @@ static int delta_equals(const void *a, const void *b);
 static void delta_act(const void *client);
 
 static struct delta_list client_table = {
-	.resolution = 1,
-	.interval = 10,
+	.timeout_ms = CLIENT_TIMEOUT,
 	.size = 0,
-	.delta = 0,
-	.delta_head = NULL,
-	.delta_tail = NULL,
+	.key_size = sizeof(struct sockaddr_storage),
 	.hash = delta_hash,
 	.equals = delta_equals,
-	.act = delta_act,
-	.free = free
+	.act = delta_act
 };
 
 static unsigned long delta_hash(const void *data)
@@ -54,7 +52,9 @@ static unsigned long delta_hash(const void *data)
 		return c4->sin_addr.s_addr + c4->sin_port;
 	} else if (client->ss_family == AF_INET6) {
 		struct sockaddr_in6 *c6 = (struct sockaddr_in6*) client;
-		return (in_addr_t) c6->sin6_addr.s6_addr[0] + c6->sin6_port;
+		const uint32_t *a = c6->sin6_addr.s6_addr32;
+		return (((uint64_t) (a[0] ^ a[1]) << 32) | (a[2] ^ a[3]))
+			+ c6->sin6_port;
 	}
 	return 0;
 }
@@ -64,6 +64,9 @@ static int delta_equals(const void *a, const void *b)
 	return sockaddr_equals(a, b);
 }
 
+DEFINE_DELTA_LIST(client_delta, struct sockaddr_storage, delta_hash,
+		delta_equals)
+
 static void delta_act(const void *data)
 {
 #ifdef PSNETLOG
@@ -77,8 +80,9 @@ static void delta_act(const void *data)
 #endif
 }
 
-void clients_init(void)
+void clients_init(unsigned int timeout_ms)
 {
+	client_table.timeout_ms = timeout_ms;
 	delta_init(&client_table);
 }
 
@@ -97,18 +101,165 @@ static int make_client(struct sockaddr_storage *addr, const char *port)
 
 int add_client(struct sockaddr_storage *addr, const char *port)
 {
-	struct sockaddr_storage *client;
+	struct sockaddr_storage client = *addr;
+
+	if (make_client(&client, port))
+		return -1;
+
+	if (client_delta_update(&client_table, &client) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Keepalives received by a UDP worker are collected in its own batch, and
+ * applied to the client table together by flush_clients().  Every thread's
+ * batch is also on a global list, so that remove_client() can withdraw a
+ * keepalive still waiting in any of them; otherwise it would bring the client
+ * back once flushed.  The batch lock is only contended by removals.
+ *
+ * Disconnects are collected in a single shared batch, since they are rare and
+ * may cancel a keepalive queued by any thread.  Every flush applies the
+ * pending disconnects before its own keepalives, so a client that disconnects
+ * and then reconnects is left in the table.
+ *
+ * Batches live as long as the process, as the threads which use them do.
+ */
+struct client_batch {
+	pthread_mutex_t lock;
+	unsigned int nr;
+	struct sockaddr_storage clients[CLIENT_BATCH];
+	struct list_head chain; /* position in `batches' */
+};
+
+static LIST_HEAD(batches);
+static pthread_mutex_t batches_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct client_batch *batch;
+
+static struct client_batch gone = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.nr = 0
+};
+
+static struct client_batch *get_batch(void)
+{
+	if (batch)
+		return batch;
+
+	if (!(batch = malloc(sizeof(struct client_batch))))
+		return NULL;
+	pthread_mutex_init(&batch->lock, NULL);
+	batch->nr = 0;
+
+	pthread_mutex_lock(&batches_lock);
+	list_add(&batch->chain, &batches);
+	pthread_mutex_unlock(&batches_lock);
+	return batch;
+}
+
+/*
+ * Applies a batch to the client table, adding its clients (or removing them,
+ * if `remove' is set).  The batch lock must be held.
+ */
+static void flush_batch(struct client_batch *b, int remove)
+{
+	const data_t *clients[CLIENT_BATCH];
+	int rc[CLIENT_BATCH];
+
+	for (unsigned int i = 0; i < b->nr; i++)
+		clients[i] = &b->clients[i];
+	if (remove)
+		delta_remove_many(&client_table, clients, rc, b->nr);
+	else
+		delta_update_many(&client_table, clients, rc, b->nr);
+	b->nr = 0;
+}
+
+/*
+ * Applies the pending disconnects.
+ */
+static void flush_gone(void)
+{
+	if (!__atomic_load_n(&gone.nr, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&gone.lock);
+	if (gone.nr)
+		flush_batch(&gone, 1);
+	pthread_mutex_unlock(&gone.lock);
+}
 
-	client = malloc(sizeof(struct sockaddr_storage));
-	*client = *addr;
+/*
+ * As add_client(), but deferred until the next call to flush_clients() (or
+ * until CLIENT_BATCH clients are waiting).  Returns -1 if the port is
+ * invalid.
+ */
+int queue_client(struct sockaddr_storage *addr, const char *port)
+{
+	struct sockaddr_storage client = *addr;
+	struct client_batch *b;
 
-	if (make_client(client, port))
+	if (make_client(&client, port))
 		return -1;
+	if (!(b = get_batch())) {
+		flush_gone();
+		return add_client(addr, port);
+	}
 
-	delta_update(&client_table, client);
+	pthread_mutex_lock(&b->lock);
+	b->clients[b->nr] = client;
+	if (++b->nr == CLIENT_BATCH) {
+		flush_gone();
+		flush_batch(b, 0);
+	}
+	pthread_mutex_unlock(&b->lock);
 	return 0;
 }
 
+/*
+ * Applies the pending disconnects, then adds or refreshes the clients queued
+ * by the calling thread.
+ */
+void flush_clients(void)
+{
+	flush_gone();
+	if (!batch)
+		return;
+
+	pthread_mutex_lock(&batch->lock);
+	if (batch->nr)
+		flush_batch(batch, 0);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * Drops any queued keepalives from `client', in every thread's batch.  Must be
+ * called with `batches_lock' held.
+ */
+static void withdraw_client(const struct sockaddr_storage *client)
+{
+	struct client_batch *b;
+	unsigned int i, n;
+
+	list_for_each_entry(b, &batches, chain) {
+		pthread_mutex_lock(&b->lock);
+		for (i = 0, n = 0; i < b->nr; i++) {
+			if (sockaddr_equals((struct sockaddr*) client,
+						(struct sockaddr*) &b->clients[i]))
+				continue;
+			b->clients[n++] = b->clients[i];
+		}
+		b->nr = n;
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+/*
+ * Removes a client, along with any keepalive from it not yet applied.  The
+ * removal itself is deferred until the next call to flush_clients() from any
+ * thread (or until CLIENT_BATCH disconnects are waiting).  Returns -1 if the
+ * port is invalid.
+ */
 int remove_client(struct sockaddr_storage *addr, const char *port)
 {
 	struct sockaddr_storage client = *addr;
@@ -116,8 +267,14 @@ int remove_client(struct sockaddr_storage *addr, const char *port)
 	if (make_client(&client, port))
 		return -1;
 
-	if (delta_remove(&client_table, &client))
-		return -1;
+	pthread_mutex_lock(&batches_lock);
+	withdraw_client(&client);
+	pthread_mutex_lock(&gone.lock);
+	gone.clients[gone.nr] = client;
+	if (++gone.nr == CLIENT_BATCH)
+		flush_batch(&gone, 1);
+	pthread_mutex_unlock(&gone.lock);
+	pthread_mutex_unlock(&batches_lock);
 	return 0;
 }
 
@@ -200,19 +357,26 @@ int clients_to_json(struct list_head *head, struct sockaddr_storage *ign,
 	return CL_OK;
 }
 
-static int fwd_to_client(const void *data, void *arg)
+static int fanout_add_client(const void *data, void *arg)
 {
-	struct msg_info *mi = arg;
-	udp_send(data, mi->len, mi->msg);
+	udp_fanout_add(arg, data);
 	return 0;
 }
 
-int flood_to_clients(struct msg_info *mi)
+/*
+ * Adds every client to the destinations of the given fanout.
+ */
+int flood_to_clients(struct udp_fanout *fo)
 {
-	delta_foreach(&client_table, fwd_to_client, mi);
+	delta_foreach(&client_table, fanout_add_client, fo);
 	return CL_OK;
 }
 
+void client_alloc_stats(struct slab_stats *stats)
+{
+	delta_alloc_stats(&client_table, stats);
+}
+
 unsigned int client_list_size(void)
 {
 	return delta_size(&client_table);
@@ -18,181 +18,518 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <unistd.h>
 
 #include "deltalist.h"
+#include "slab.h"
+#include "timer.h"
 
-struct delta_node {
-	const data_t *data;
-	unsigned int delta;         // delta for delta list
-	struct delta_node *ht_next; // hash table next pointer
-	struct delta_node *dl_next; // delta list next pointer
-	struct delta_node *dl_prev; // delta list prev pointer
-};
+#define HT_REHASH_STEP 4 // buckets moved per operation during a resize
+#define LAZY_REAP      2 // expired elements removed per insertion, if lazy
 
 /*
- * Finds the struct delta_node associated with a given element, if that element
- * exists in the table.  If the element does not exist, NULL is returned. If
- * `prev' is not NULL, then prev will be set to the previous element in the
- * hash table bucket when this function returns.
+ * Hashes an element.
  */
-static struct delta_node *get_node(struct delta_list *table,
-		const data_t *data, struct delta_node **prev)
+static unsigned long hash_data(struct delta_list *table, const data_t *data)
 {
-	unsigned long index;
-	struct delta_node *it, *last;
+	return delta_mix_hash(table->hash(data));
+}
 
-	index = table->hash(data) % HT_SIZE;
+/*
+ * Finds the link pointing to the node for `data'; see __delta_get_link().
+ */
+static struct delta_node **get_link(struct delta_list *table,
+		struct delta_stripe *s, const data_t *data, unsigned long hash)
+{
+	return __delta_get_link(s, data, hash, table->equals);
+}
 
-	last = NULL;
-	for (it = table->table[index]; it; it = it->ht_next) {
-		if (table->equals(it->data, data))
-			break;
-		last = it;
+/*
+ * As get_link(), but an expired element of a lazy table is removed and
+ * reported as absent; see __delta_find().
+ */
+static struct delta_node **find_link(struct delta_list *table,
+		struct delta_stripe *s, const data_t *data, unsigned long hash)
+{
+	return __delta_find(table, s, data, hash, table->equals);
+}
+
+/*
+ * Inserts a node into a bucket in the hash table.
+ */
+static void hash_insert(struct delta_stripe *s, struct delta_node *node)
+{
+	unsigned long index = node->hash & (s->nr_buckets - 1);
+
+	node->ht_next = s->table[index];
+	s->table[index] = node;
+}
+
+/*
+ * Moves a few buckets from the old bucket array to the new one, if a resize is
+ * in progress.  Empty buckets are cheap to skip, so more of them are allowed.
+ */
+static void rehash_step(struct delta_stripe *s)
+{
+	struct delta_node *node, *next;
+	int moves = HT_REHASH_STEP;
+	int skips = HT_REHASH_STEP * 10;
+
+	if (!s->old_table)
+		return;
+
+	while (moves && skips && s->rehash_pos < s->old_nr_buckets) {
+		node = s->old_table[s->rehash_pos];
+		s->old_table[s->rehash_pos++] = NULL;
+		if (!node) {
+			skips--;
+			continue;
+		}
+		for (; node; node = next) {
+			next = node->ht_next;
+			hash_insert(s, node);
+		}
+		moves--;
 	}
 
-	if (prev)
-		*prev = last;
+	if (s->rehash_pos == s->old_nr_buckets) {
+		free(s->old_table);
+		s->old_table = NULL;
+	}
+}
+
+/*
+ * Starts a resize if the load factor has left the range [1/8, 1].  The new
+ * bucket array is filled by subsequent calls to rehash_step().
+ */
+static void maybe_resize(struct delta_stripe *s)
+{
+	struct delta_node **buckets;
+	unsigned long nr;
+
+	if (s->old_table)
+		return;
+
+	if (s->size > s->nr_buckets)
+		nr = s->nr_buckets * 2;
+	else if (s->nr_buckets > HT_MIN_SIZE && s->size < s->nr_buckets / 8)
+		nr = s->nr_buckets / 2;
+	else
+		return;
+
+	/* on failure, carry on with the current array */
+	if (!(buckets = calloc(nr, sizeof(struct delta_node*))))
+		return;
 
-	return it;
+	s->old_table = s->table;
+	s->old_nr_buckets = s->nr_buckets;
+	s->rehash_pos = 0;
+	s->table = buckets;
+	s->nr_buckets = nr;
 }
 
 /*
- * Inserts a node into a bucket in the hash table.
+ * Snapshots let delta_foreach() walk a stripe without holding its lock.  A
+ * snapshot is an array of the elements at the time it was taken; it is shared
+ * by every iteration until the stripe's membership next changes, and freed
+ * when its last reader is done.
+ *
+ * A removed node may still be visible to any snapshot taken before it was
+ * removed, so it is "retired" to the newest snapshot instead of being freed.
+ * When a snapshot is released, its retired nodes are passed to the next older
+ * snapshot, or freed if there is none.
+ */
+struct delta_snapshot {
+	struct list_head chain;   // position in stripe->snapshots
+	unsigned int refs;
+	struct list_head retired; // nodes removed while this was the newest
+	unsigned int nr;          // number of elements in `items'
+	const data_t *items[];
+};
+
+static void free_node(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node *node)
+{
+	if (table->intrusive) {
+		/* the node is part of the element */
+		table->free((data_t*)node->data);
+		return;
+	}
+	if (!table->key_size)
+		table->free((data_t*)node->data);
+	slab_free(&s->nodes_slab, node);
+}
+
+/*
+ * Frees a node which has been removed from the table, or defers that until no
+ * snapshot can refer to it.  The node's chain is reused for the retired list.
  */
-static void hash_insert(struct delta_list *table, struct delta_node *node)
+static void retire_node(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node *node)
 {
-	unsigned long index = table->hash(node->data) % HT_SIZE;
+	struct delta_snapshot *newest;
 
-	node->ht_next = table->table[index];
-	table->table[index] = node;
+	if (list_empty(&s->snapshots)) {
+		free_node(table, s, node);
+		return;
+	}
+	newest = list_entry(s->snapshots.prev, struct delta_snapshot, chain);
+	list_add_tail(&node->chain, &newest->retired);
 }
 
 /*
- * Inserts a node into the delta list.
+ * Drops a reference to a snapshot.  The stripe lock must be held.
  */
-static void dl_insert_node(struct delta_list *table, struct delta_node *node)
+static void snapshot_put(struct delta_list *table, struct delta_stripe *s,
+		struct delta_snapshot *snap)
 {
-	node->delta = table->interval;
+	struct delta_snapshot *older;
+	struct delta_node *node, *next;
+
+	if (--snap->refs)
+		return;
 
-	if (!table->delta_head) {
-		table->delta_head = table->delta_tail = node;
-		node->dl_prev = NULL;
+	if (snap->chain.prev != &s->snapshots) {
+		older = list_entry(snap->chain.prev, struct delta_snapshot,
+				chain);
+		list_splice_tail(&snap->retired, &older->retired);
 	} else {
-		node->delta -= table->delta;
+		list_for_each_entry_safe(node, next, &snap->retired, chain)
+			free_node(table, s, node);
+	}
+	list_del(&snap->chain);
+	free(snap);
+}
 
-		table->delta_tail->dl_next = node;
-		node->dl_prev = table->delta_tail;
-		table->delta_tail = node;
+/*
+ * Returns a reference to a snapshot of the stripe's current elements, taking
+ * one if the last is out of date.  Returns NULL if memory is exhausted.  The
+ * stripe lock must be held.
+ */
+static struct delta_snapshot *snapshot_get(struct delta_stripe *s)
+{
+	struct delta_snapshot *snap;
+	struct delta_node *node;
+	unsigned int i = 0;
+
+	if (!(snap = s->snapshot)) {
+		snap = malloc(sizeof(struct delta_snapshot) +
+				s->size * sizeof(const data_t*));
+		if (!snap)
+			return NULL;
+
+		list_for_each_entry(node, &s->nodes, chain)
+			snap->items[i++] = node->data;
+		snap->nr = i;
+		snap->refs = 1; /* the stripe's reference */
+		INIT_LIST_HEAD(&snap->retired);
+		list_add_tail(&snap->chain, &s->snapshots);
+		s->snapshot = snap;
 	}
-	node->dl_next = NULL;
 
-	table->delta = table->interval;
+	snap->refs++;
+	return snap;
 }
 
 /*
- * Removes a node from the main linked list (but not the hash table).
+ * Marks the current snapshot out of date, after the stripe's membership has
+ * changed.  The stripe lock must be held.
  */
-static void dl_remove_node(struct delta_list *table, struct delta_node *node)
+static void snapshot_invalidate(struct delta_list *table,
+		struct delta_stripe *s)
 {
-	if (node->dl_next) {
-		node->dl_next->delta += node->delta;
-		node->dl_next->dl_prev = node->dl_prev;
-	} else {
-		table->delta -= node->delta;
+	if (s->snapshot) {
+		snapshot_put(table, s, s->snapshot);
+		s->snapshot = NULL;
 	}
+}
 
-	if (node->dl_prev)
-		node->dl_prev->dl_next = node->dl_next;
-	else
-		table->delta_head = node->dl_next;
+static void reap(struct delta_list *table, struct delta_stripe *s,
+		unsigned int max);
+
+/*
+ * Adds a node to the hash table (but not the timing wheel).
+ */
+static void link_node(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node *node, unsigned long hash)
+{
+	if (table->lazy)
+		reap(table, s, LAZY_REAP);
+
+	node->hash = hash;
+	hash_insert(s, node);
+	s->size++;
+	__atomic_add_fetch(&table->size, 1, __ATOMIC_RELAXED);
+	snapshot_invalidate(table, s);
+
+	rehash_step(s);
+	maybe_resize(s);
 }
 
 /*
- * Removes an element from the table.  Returns 0 on success, or -1 if the given
- * element is not in the table.
+ * Creates a node for `data' and adds it to the hash table (but not the timing
+ * wheel).  Returns NULL if memory is exhausted, or if the table is intrusive:
+ * its nodes come from the caller.
  */
-static int delta_delete(struct delta_list *table, const data_t *data)
+static struct delta_node *new_node(struct delta_list *table,
+		struct delta_stripe *s, const data_t *data, unsigned long hash)
 {
-	unsigned long index;
-	struct delta_node *node, *prev;
+	struct delta_node *node;
 
-	if (!(node = get_node(table, data, &prev)))
-		return -1;
+	if (table->intrusive || !(node = slab_alloc(&s->nodes_slab)))
+		return NULL;
 
-	/* remove from hash table */
-	if (prev) {
-		prev->ht_next = node->ht_next;
+	if (table->key_size) {
+		memcpy(node->key, data, table->key_size);
+		node->data = node->key;
 	} else {
-		index = table->hash(data) % HT_SIZE;
-		table->table[index] = node->ht_next;
+		node->data = data;
 	}
+	link_node(table, s, node, hash);
+	return node;
+}
 
-	/* remove from delta list */
-	dl_remove_node(table, node);
-
-	table->size--;
-	table->free((data_t*)node->data);
-	free(node);
+/*
+ * Returns the current time in milliseconds, which is the wheel's tick.
+ */
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
 
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*
- * Increases "time" by one tick, removing expired nodes when appropriate.
+ * Returns the time from which expiry times are computed.  Lazy tables compare
+ * timestamps on every lookup, so they use the cheaper coarse clock.
  */
-static void delta_tick(struct delta_list *table)
+static uint64_t clock_ms(struct delta_list *table)
 {
-	data_t *tmp_data;
+	struct timespec ts;
 
-	pthread_mutex_lock(&table->lock);
+	if (!table->lazy)
+		return now_ms();
 
-	if (!table->delta_head) {
-		pthread_mutex_unlock(&table->lock);
-		return;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * (Re)starts a node's timer to fire at `expires', and moves it to the end of
+ * the node list.
+ */
+static void schedule_node(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node *node, uint64_t expires)
+{
+	if (table->lazy) {
+		/* not on the wheel, just timestamped */
+		node->timer.expires = expires;
+		INIT_LIST_HEAD(&node->timer.chain);
+	} else {
+		timer_wheel_add(&s->wheel, &node->timer, expires);
 	}
+	list_add_tail(&node->chain, &s->nodes);
+}
+
+static void unschedule_node(struct delta_node *node)
+{
+	timer_wheel_del(&node->timer);
+	list_del(&node->chain);
+}
+
+/*
+ * Unlinks the node at `link' from the table, leaving the caller to retire it.
+ */
+static struct delta_node *unlink_node(struct delta_list *table,
+		struct delta_stripe *s, struct delta_node **link)
+{
+	struct delta_node *node = *link;
 
-	table->delta--;
-	table->delta_head->delta--;
+	/* remove from hash table */
+	*link = node->ht_next;
 
-	/* remove any expired elements */
-	while (table->delta_head && !table->delta_head->delta) {
-		tmp_data = (data_t*) table->delta_head->data;
+	/* remove from timing wheel and node list */
+	unschedule_node(node);
 
-		table->act(tmp_data);
+	s->size--;
+	__atomic_sub_fetch(&table->size, 1, __ATOMIC_RELAXED);
+	snapshot_invalidate(table, s);
 
-		delta_delete(table, tmp_data);
+	rehash_step(s);
+	maybe_resize(s);
+	return node;
+}
+
+/*
+ * Removes the node at `link' from the table.  The stripe lock must be held.
+ */
+void __delta_remove_locked(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node **link)
+{
+	retire_node(table, s, unlink_node(table, s, link));
+}
+
+/*
+ * Lazy tables are not timed out by the timer service.  Instead, an expired
+ * element is treated as absent by lookups and removed when found, and each
+ * insertion removes up to LAZY_REAP elements from the head of the stripe's
+ * node list if they have expired.  `act' is called with the stripe lock held.
+ */
+static void expire_node(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node **link)
+{
+	struct delta_node *node = unlink_node(table, s, link);
+
+	table->act(node->data);
+	retire_node(table, s, node);
+}
+
+/*
+ * Removes up to `max' expired elements from the head of a lazy stripe's node
+ * list, stopping at the first live one.  The head is the least recently
+ * updated element, which is the next to expire unless elements have
+ * different timeouts.
+ */
+static void reap(struct delta_list *table, struct delta_stripe *s,
+		unsigned int max)
+{
+	uint64_t now = clock_ms(table);
+	struct delta_node *node;
+
+	while (max-- && !list_empty(&s->nodes)) {
+		node = list_entry(s->nodes.next, struct delta_node, chain);
+		if (node->timer.expires > now)
+			break;
+		expire_node(table, s,
+				get_link(table, s, node->data, node->hash));
 	}
-	pthread_mutex_unlock(&table->lock);
 }
 
 /*
- * Clock thread: calls the delta_tick() function every table->resolution
- * seconds.
+ * Removes the node at `link' from a lazy table if it has expired, returning
+ * NULL in that case and `link' otherwise.  The stripe lock must be held.
+ */
+struct delta_node **__delta_expire_link(struct delta_list *table,
+		struct delta_stripe *s, struct delta_node **link)
+{
+	if ((*link)->timer.expires > clock_ms(table))
+		return link;
+	expire_node(table, s, link);
+	return NULL;
+}
+
+/*
+ * Advances a stripe's timing wheel to `now', removing expired nodes.
+ *
+ * Fired timers are collected on s->expired, and removed from it at most
+ * `expire_batch' at a time; each batch is unlinked under the lock, and passed
+ * to `act' after it is released.  An element which is updated or removed
+ * while waiting on s->expired leaves it, and so does not expire.
  */
-static _Noreturn void *clock_thread(void *data)
+static void stripe_tick(struct delta_list *table, struct delta_stripe *s,
+		uint64_t now)
+{
+	unsigned int batch_size = table->expire_batch ? table->expire_batch :
+		DELTA_EXPIRE_BATCH;
+	struct delta_node *node, *next;
+	LIST_HEAD(batch);
+
+	pthread_mutex_lock(&s->lock);
+
+	timer_wheel_advance(&s->wheel, now, &s->expired);
+
+	while (!list_empty(&s->expired)) {
+		for (unsigned int i = 0; i < batch_size; i++) {
+			if (list_empty(&s->expired))
+				break;
+			node = list_entry(s->expired.next, struct delta_node,
+					timer.chain);
+			unlink_node(table, s,
+				get_link(table, s, node->data, node->hash));
+			/* unlinked nodes are only reachable from `batch' */
+			list_add_tail(&node->timer.chain, &batch);
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		list_for_each_entry(node, &batch, timer.chain)
+			table->act(node->data);
+
+		pthread_mutex_lock(&s->lock);
+		list_for_each_entry_safe(node, next, &batch, timer.chain)
+			retire_node(table, s, node);
+		INIT_LIST_HEAD(&batch);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+static unsigned int delta_timer(void *data)
 {
 	struct delta_list *table = data;
-	unsigned int left;
+	uint64_t now = now_ms();
 
-	pthread_detach(pthread_self());
+	for (unsigned int i = 0; i < table->nr_stripes; i++)
+		stripe_tick(table, &table->stripes[i], now);
+	return table->tick_ms;
+}
 
-	for (;;) {
-		for (left = table->resolution; left; left = sleep(left));
-			delta_tick(table);
+static void stripe_init(struct delta_list *table, struct delta_stripe *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->nr_buckets = HT_MIN_SIZE;
+	s->table = calloc(HT_MIN_SIZE, sizeof(struct delta_node*));
+	if (!s->table) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
 	}
+
+	timer_wheel_init(&s->wheel, now_ms());
+	INIT_LIST_HEAD(&s->expired);
+	INIT_LIST_HEAD(&s->nodes);
+	INIT_LIST_HEAD(&s->snapshots);
+	slab_init(&s->nodes_slab, sizeof(struct delta_node) + table->key_size);
+
+	if (pthread_mutex_init(&s->lock, NULL))
+		perror("pthread_mutex_init");
 }
 
 void delta_init(struct delta_list *table)
 {
-	pthread_t tid;
+	unsigned int n;
+
+	if (!table->tick_ms) {
+		table->tick_ms = table->timeout_ms / 10;
+		if (table->tick_ms > 1000)
+			table->tick_ms = 1000;
+		if (table->tick_ms < 1)
+			table->tick_ms = 1;
+	}
 
-	if (pthread_mutex_init(&table->lock, NULL))
-		perror("pthread_mutex_init");
-	if (pthread_create(&tid, NULL, clock_thread, table))
-		perror("pthread_create");
+	if (!table->nr_stripes)
+		table->nr_stripes = DELTA_STRIPES;
+	if (table->nr_stripes > DELTA_MAX_STRIPES)
+		table->nr_stripes = DELTA_MAX_STRIPES;
+	for (n = 1; n < table->nr_stripes; n *= 2)
+		;
+	table->nr_stripes = n;
+
+	if (posix_memalign((void**) &table->stripes,
+				__alignof__(struct delta_stripe),
+				n * sizeof(struct delta_stripe))) {
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned int i = 0; i < n; i++)
+		stripe_init(table, &table->stripes[i]);
+
+	if (!table->lazy)
+		timer_schedule(table->tick_ms, delta_timer, table);
 }
 
 /*
@@ -201,75 +538,232 @@ void delta_init(struct delta_list *table)
  */
 void delta_insert(struct delta_list *table, const data_t *data)
 {
-	struct delta_node *node, *prev;
+	unsigned long hash = hash_data(table, data);
+	struct delta_stripe *s = delta_stripe(table, hash);
+	struct delta_node *node;
 
-	pthread_mutex_lock(&table->lock);
+	pthread_mutex_lock(&s->lock);
 
-	if (!(node = get_node(table, data, &prev))) {
-		node = malloc(sizeof(struct delta_node));
-		node->data = data;
-		hash_insert(table, node);
-		dl_insert_node(table, node);
-		table->size++;
-	}
+	if (!find_link(table, s, data, hash) &&
+			(node = new_node(table, s, data, hash)))
+		schedule_node(table, s, node, clock_ms(table) + table->timeout_ms);
 
-	pthread_mutex_unlock(&table->lock);
+	pthread_mutex_unlock(&s->lock);
 }
 
 /*
- * Relocates a node to the end of the list if the data corresponding to the
- * argument is already in the list; otherwise allocates a new node and puts it
- * at the end of the list.
+ * Restarts the timer of the element corresponding to the argument if it is
+ * already in the list, with the table's default timeout; otherwise inserts it.
+ * Returns 1 if the element was already present, 0 if it was inserted, or -1
+ * if memory is exhausted.
  */
 int delta_update(struct delta_list *table, const data_t *data)
 {
-	struct delta_node *node, *prev;
+	return delta_update_timeout(table, data, table->timeout_ms);
+}
+
+/*
+ * As delta_update(), but the element expires after `timeout_ms' milliseconds
+ * instead of the table's default.
+ */
+int delta_update_timeout(struct delta_list *table, const data_t *data,
+		unsigned int timeout_ms)
+{
+	unsigned long hash = hash_data(table, data);
+	struct delta_stripe *s = delta_stripe(table, hash);
 	int rc;
 
-	pthread_mutex_lock(&table->lock);
+	pthread_mutex_lock(&s->lock);
+	rc = __delta_update_locked(table, s, find_link(table, s, data, hash),
+			data, hash, timeout_ms);
+	pthread_mutex_unlock(&s->lock);
+
+	return rc;
+}
+
+/*
+ * As __delta_update_locked(), with an absolute expiry time.
+ */
+static int update_locked(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node **link, const data_t *data, unsigned long hash,
+		uint64_t expires)
+{
+	struct delta_node *node;
+	int rc;
 
-	if ((node = get_node(table, data, &prev))) {
-		dl_remove_node(table, node);
+	if (link) {
+		node = *link;
+		unschedule_node(node);
 		rc = 1;
-	} else {
-		node = malloc(sizeof(struct delta_node));
-		node->data = data;
-		hash_insert(table, node);
-		table->size++;
+	} else if ((node = new_node(table, s, data, hash))) {
 		rc = 0;
+	} else {
+		return -1;
 	}
-	dl_insert_node(table, node);
-
-	pthread_mutex_unlock(&table->lock);
+	schedule_node(table, s, node, expires);
 
 	return rc;
 }
 
 /*
- * Thread-safe interface to delta_delete().
+ * The body of delta_update_timeout(), given the result of the lookup: restarts
+ * the timer of the node at `link', or inserts `data' if `link' is NULL.  The
+ * stripe lock must be held.
  */
-int delta_remove(struct delta_list *table, const data_t *data)
+int __delta_update_locked(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node **link, const data_t *data, unsigned long hash,
+		unsigned int timeout_ms)
 {
+	return update_locked(table, s, link, data, hash,
+			clock_ms(table) + timeout_ms);
+}
+
+/*
+ * The intrusive counterpart of delta_update_timeout(): `node' is embedded in
+ * the element, and node->data points to it.  If an equal element is already
+ * in the table its timer is restarted and 1 returned, leaving `node' unused;
+ * otherwise `node' itself is linked into the table, and 0 returned.
+ */
+int delta_update_node_timeout(struct delta_list *table,
+		struct delta_node *node, unsigned int timeout_ms)
+{
+	unsigned long hash = hash_data(table, node->data);
+	struct delta_stripe *s = delta_stripe(table, hash);
+	struct delta_node **link;
 	int rc;
 
-	pthread_mutex_lock(&table->lock);
-	rc = delta_delete(table, data);
-	pthread_mutex_unlock(&table->lock);
+	pthread_mutex_lock(&s->lock);
+	if ((link = find_link(table, s, node->data, hash))) {
+		node = *link;
+		unschedule_node(node);
+		rc = 1;
+	} else {
+		link_node(table, s, node, hash);
+		rc = 0;
+	}
+	schedule_node(table, s, node, clock_ms(table) + timeout_ms);
+	pthread_mutex_unlock(&s->lock);
 
 	return rc;
 }
 
+int delta_update_node(struct delta_list *table, struct delta_node *node)
+{
+	return delta_update_node_timeout(table, node, table->timeout_ms);
+}
+
+/*
+ * Removes an element from the table.  Returns 0 on success, or -1 if the given
+ * element is not in the table.
+ */
+int delta_remove(struct delta_list *table, const data_t *data)
+{
+	unsigned long hash = hash_data(table, data);
+	struct delta_stripe *s = delta_stripe(table, hash);
+	struct delta_node **link;
+
+	pthread_mutex_lock(&s->lock);
+	if ((link = find_link(table, s, data, hash)))
+		__delta_remove_locked(table, s, link);
+	pthread_mutex_unlock(&s->lock);
+
+	return link ? 0 : -1;
+}
+
+/*
+ * Applies delta_update() (if `remove' is 0) or delta_remove() to at most
+ * DELTA_BATCH elements, taking each stripe's lock once for all of its
+ * elements.  The results are stored in `rc', and the number of successes
+ * returned.
+ */
+static unsigned int update_batch(struct delta_list *table,
+		const data_t *const data[], int rc[], unsigned int n, int remove)
+{
+	uint64_t expires = clock_ms(table) + table->timeout_ms;
+	unsigned long hash[DELTA_BATCH];
+	unsigned char done[DELTA_BATCH];
+	struct delta_stripe *s;
+	struct delta_node **link;
+	unsigned int ok = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		hash[i] = hash_data(table, data[i]);
+		done[i] = 0;
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		if (done[i])
+			continue;
+		s = delta_stripe(table, hash[i]);
+
+		pthread_mutex_lock(&s->lock);
+		for (unsigned int j = i; j < n; j++) {
+			if (delta_stripe(table, hash[j]) == s)
+				__builtin_prefetch(&s->table[hash[j] &
+						(s->nr_buckets - 1)]);
+		}
+		for (unsigned int j = i; j < n; j++) {
+			if (done[j] || delta_stripe(table, hash[j]) != s)
+				continue;
+			done[j] = 1;
+			link = find_link(table, s, data[j], hash[j]);
+			if (remove) {
+				if (link)
+					__delta_remove_locked(table, s, link);
+				rc[j] = link ? 0 : -1;
+				ok += !!link;
+			} else {
+				rc[j] = update_locked(table, s, link, data[j],
+						hash[j], expires);
+				ok += rc[j] >= 0;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	return ok;
+}
+
+static unsigned int update_many(struct delta_list *table,
+		const data_t *const data[], int rc[], unsigned int n, int remove)
+{
+	unsigned int ok = 0;
+
+	for (unsigned int i = 0; i < n; i += DELTA_BATCH)
+		ok += update_batch(table, data + i, rc + i,
+				n - i < DELTA_BATCH ? n - i : DELTA_BATCH,
+				remove);
+	return ok;
+}
+
+/*
+ * Calls delta_update() on each of the `n' elements of `data', storing the
+ * results in `rc'.  Elements are grouped by stripe, so that each lock is taken
+ * once per batch rather than once per element.  Returns the number of elements
+ * updated or inserted.
+ */
+unsigned int delta_update_many(struct delta_list *table,
+		const data_t *const data[], int rc[], unsigned int n)
+{
+	return update_many(table, data, rc, n, 0);
+}
+
+/*
+ * Calls delta_remove() on each of the `n' elements of `data', as
+ * delta_update_many().  Returns the number of elements removed.
+ */
+unsigned int delta_remove_many(struct delta_list *table,
+		const data_t *const data[], int rc[], unsigned int n)
+{
+	return update_many(table, data, rc, n, 1);
+}
+
 /*
  * Returns true if the given element exists in the table, or false if it does
  * not.
  */
 int delta_contains(struct delta_list *table, const data_t *data)
 {
-	pthread_mutex_lock(&table->lock);
-	struct delta_node *rv = get_node(table, data, NULL);
-	pthread_mutex_unlock(&table->lock);
-
-	return rv ? 1 : 0;
+	return delta_get(table, data) != NULL;
 }
 
 /*
@@ -279,13 +773,17 @@ int delta_contains(struct delta_list *table, const data_t *data)
  */
 const data_t *delta_get(struct delta_list *table, const data_t *data)
 {
-	struct delta_node *node;
+	unsigned long hash = hash_data(table, data);
+	struct delta_stripe *s = delta_stripe(table, hash);
+	struct delta_node **link;
+	const data_t *rv;
 
-	pthread_mutex_lock(&table->lock);
-	node = get_node(table, data, NULL);
-	pthread_mutex_unlock(&table->lock);
+	pthread_mutex_lock(&s->lock);
+	link = find_link(table, s, data, hash);
+	rv = link ? (*link)->data : NULL;
+	pthread_mutex_unlock(&s->lock);
 
-	return node ? node->data : NULL;
+	return rv;
 }
 
 /*
@@ -293,43 +791,115 @@ const data_t *delta_get(struct delta_list *table, const data_t *data)
  */
 void delta_clear(struct delta_list *table)
 {
+	struct delta_stripe *s;
 	struct delta_node *it, *tmp;
 
-	pthread_mutex_lock(&table->lock);
+	for (unsigned int i = 0; i < table->nr_stripes; i++) {
+		s = &table->stripes[i];
+		pthread_mutex_lock(&s->lock);
 
-	it = table->delta_head;
-	while (it) {
-		tmp = it;
-		it = it->dl_next;
-		free(tmp);
-	}
+		snapshot_invalidate(table, s);
+		list_for_each_entry_safe(it, tmp, &s->nodes, chain) {
+			timer_wheel_del(&it->timer);
+			list_del(&it->chain);
+			retire_node(table, s, it);
+		}
 
-	table->size = 0;
-	table->delta = 0;
-	table->delta_head = NULL;
-	table->delta_tail = NULL;
+		__atomic_sub_fetch(&table->size, s->size, __ATOMIC_RELAXED);
+		s->size = 0;
 
-	for (int i = 0; i < HT_SIZE; i++)
-		table->table[i] = NULL;
+		free(s->old_table);
+		s->old_table = NULL;
+		memset(s->table, 0, s->nr_buckets * sizeof(struct delta_node*));
 
-	pthread_mutex_unlock(&table->lock);
+		pthread_mutex_unlock(&s->lock);
+	}
 }
 
 /*
- * Calls the function `fun' on each element in the list.  A non-zero return
- * value from `fun' is taken to indicate that iteration should cease.
+ * Calls the function `fun' on each element in the list, stripe by stripe,
+ * and within a stripe least recently updated first (as of the last insertion
+ * or removal).  A non-zero return value from `fun' is taken to indicate that
+ * iteration should cease.
+ *
+ * The walk is over snapshots, without any lock held: `fun' does not hold up
+ * other users of the table, and may itself modify the table.  Elements
+ * removed during the walk remain valid until it finishes.
  */
 void delta_foreach(struct delta_list *table,
 		int (*fun)(const data_t *it, void *arg), void *arg)
 {
-	struct delta_node *it;
+	struct delta_stripe *s;
+	struct delta_snapshot *snap;
+	int stop = 0;
+
+	for (unsigned int i = 0; i < table->nr_stripes && !stop; i++) {
+		s = &table->stripes[i];
+		pthread_mutex_lock(&s->lock);
+		if (table->lazy)
+			reap(table, s, UINT_MAX);
+		snap = snapshot_get(s);
+		pthread_mutex_unlock(&s->lock);
+
+		if (!snap)
+			return;
+
+		for (unsigned int j = 0; j < snap->nr && !stop; j++)
+			stop = fun(snap->items[j], arg);
+
+		pthread_mutex_lock(&s->lock);
+		snapshot_put(table, s, snap);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
 
-	pthread_mutex_lock(&table->lock);
-	for (it = table->delta_head; it; it = it->dl_next) {
-		if (fun(it->data, arg))
-			break;
+/*
+ * Calls `fun' on every live element, with the milliseconds left before it
+ * expires, until `fun' returns non-zero.  Each stripe's lock is held while its
+ * elements are visited, so `fun' must be quick and must not use the table.
+ */
+void delta_foreach_ttl(struct delta_list *table,
+		int (*fun)(const data_t *it, unsigned int ttl_ms, void *arg),
+		void *arg)
+{
+	struct delta_stripe *s;
+	struct delta_node *node;
+	uint64_t now;
+	int stop = 0;
+
+	for (unsigned int i = 0; i < table->nr_stripes && !stop; i++) {
+		s = &table->stripes[i];
+		pthread_mutex_lock(&s->lock);
+		now = clock_ms(table);
+		list_for_each_entry(node, &s->nodes, chain) {
+			if (node->timer.expires <= now)
+				continue;
+			if ((stop = fun(node->data, node->timer.expires - now,
+							arg)))
+				break;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/*
+ * Reports the node allocators' statistics, summed over the stripes.
+ */
+void delta_alloc_stats(struct delta_list *table, struct slab_stats *stats)
+{
+	struct delta_stripe *s;
+
+	memset(stats, 0, sizeof(*stats));
+	for (unsigned int i = 0; i < table->nr_stripes; i++) {
+		s = &table->stripes[i];
+		pthread_mutex_lock(&s->lock);
+		stats->object_size = s->nodes_slab.stats.object_size;
+		stats->in_use += s->nodes_slab.stats.in_use;
+		stats->free += s->nodes_slab.stats.free;
+		stats->slabs += s->nodes_slab.stats.slabs;
+		stats->allocs += s->nodes_slab.stats.allocs;
+		pthread_mutex_unlock(&s->lock);
 	}
-	pthread_mutex_unlock(&table->lock);
 }
 
 /*
@@ -337,9 +907,5 @@ void delta_foreach(struct delta_list *table,
  */
 unsigned int delta_size(struct delta_list *table)
 {
-	unsigned int rv;
-	pthread_mutex_lock(&table->lock);
-	rv = table->size;
-	pthread_mutex_unlock(&table->lock);
-	return rv;
+	return __atomic_load_n(&table->size, __ATOMIC_RELAXED);
 }
@@ -0,0 +1,184 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Fixed-size pool of msg_info objects.  All objects are allocated up front by
+ * msgpool_init(); when they are all in use msgpool_get() fails, so the pool's
+ * capacity bounds the number of datagrams and connections in flight.
+ *
+ * Each thread keeps a small cache of free objects and only takes the depot
+ * lock to exchange half a cache's worth at a time.  A thread's cache is
+ * returned to the depot when the thread exits.  Caches are kept small relative
+ * to the capacity, since objects sitting in one thread's cache can't be used by
+ * another.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "msgpool.h"
+
+#define CACHE_SIZE 32
+#define CACHE_RATIO 128 /* capacity per cached object */
+
+struct msgpool_cache {
+	int registered;   /* destructor has been set up for this thread */
+	int nr;           /* number of objects in `objs' */
+	unsigned long hits;
+	struct msg_info *objs[CACHE_SIZE + 1];
+};
+
+static struct {
+	struct msg_info **free; /* stack of free objects */
+	size_t nr_free;
+	size_t capacity;
+	int cache_limit;        /* objects kept in each thread's cache */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long exhausted;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+} depot = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static __thread struct msgpool_cache cache;
+
+/*
+ * Moves up to `n' objects from `c' to the depot.  The depot lock must be held.
+ */
+static void depot_push(struct msgpool_cache *c, int n)
+{
+	if (n > c->nr)
+		n = c->nr;
+	c->nr -= n;
+	memcpy(depot.free + depot.nr_free, c->objs + c->nr,
+			n * sizeof(struct msg_info*));
+	depot.nr_free += n;
+	depot.hits += c->hits;
+	c->hits = 0;
+}
+
+/*
+ * Moves up to `n' objects from the depot to `c'.  The depot lock must be held.
+ */
+static void depot_pop(struct msgpool_cache *c, int n)
+{
+	if ((size_t) n > depot.nr_free)
+		n = depot.nr_free;
+	depot.nr_free -= n;
+	memcpy(c->objs + c->nr, depot.free + depot.nr_free,
+			n * sizeof(struct msg_info*));
+	c->nr += n;
+	depot.hits += c->hits;
+	c->hits = 0;
+}
+
+static void cache_destroy(void *data)
+{
+	struct msgpool_cache *c = data;
+
+	pthread_mutex_lock(&depot.lock);
+	depot_push(c, c->nr);
+	pthread_mutex_unlock(&depot.lock);
+}
+
+static void cache_register(void)
+{
+	pthread_setspecific(depot.key, &cache);
+	cache.registered = 1;
+}
+
+void msgpool_init(size_t capacity)
+{
+	struct msg_info *objs;
+
+	objs = malloc(capacity * sizeof(struct msg_info));
+	depot.free = malloc(capacity * sizeof(struct msg_info*));
+	if (!objs || !depot.free) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < capacity; i++)
+		depot.free[i] = &objs[i];
+	depot.nr_free = capacity;
+	depot.capacity = capacity;
+	depot.cache_limit = capacity / CACHE_RATIO < CACHE_SIZE ?
+		capacity / CACHE_RATIO : CACHE_SIZE;
+
+	if (pthread_key_create(&depot.key, cache_destroy)) {
+		fprintf(stderr, "msgpool: failed to create thread key\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Takes an object from the pool, or returns NULL if the pool is exhausted.
+ */
+struct msg_info *msgpool_get(void)
+{
+	if (cache.nr) {
+		cache.hits++;
+		return cache.objs[--cache.nr];
+	}
+
+	if (!cache.registered)
+		cache_register();
+
+	pthread_mutex_lock(&depot.lock);
+	depot_pop(&cache, depot.cache_limit / 2 + 1);
+	if (!cache.nr) {
+		depot.exhausted++;
+		pthread_mutex_unlock(&depot.lock);
+		return NULL;
+	}
+	depot.misses++;
+	pthread_mutex_unlock(&depot.lock);
+
+	return cache.objs[--cache.nr];
+}
+
+void msgpool_put(struct msg_info *mi)
+{
+	if (!cache.registered)
+		cache_register();
+
+	cache.objs[cache.nr++] = mi;
+	if (cache.nr > depot.cache_limit) {
+		pthread_mutex_lock(&depot.lock);
+		depot_push(&cache, cache.nr - depot.cache_limit / 2);
+		pthread_mutex_unlock(&depot.lock);
+	}
+}
+
+/*
+ * Hits counted by other threads are only included once they next visit the
+ * depot, so the figure may lag slightly.
+ */
+void msgpool_stats(struct msgpool_stats *stats)
+{
+	pthread_mutex_lock(&depot.lock);
+	stats->capacity = depot.capacity;
+	stats->hits = depot.hits;
+	stats->misses = depot.misses;
+	stats->exhausted = depot.exhausted;
+	pthread_mutex_unlock(&depot.lock);
+}
@@ -16,18 +16,94 @@
  * libpsnet.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#define _GNU_SOURCE /* sendmmsg */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <limits.h> /* IOV_MAX */
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "ipv6.h"
 #include "network.h"
 
+/*
+ * UDP sockets shared by every sender, one per address family, created on first
+ * use.  sendto() and sendmmsg() are safe to call concurrently on one socket.
+ */
+static int send_socks[2] = { -1, -1 };
+static int send_buffer;
+static int send_cork;
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int *send_sock(sa_family_t family)
+{
+	return &send_socks[family == AF_INET6];
+}
+
+static void set_send_buffer(int sock)
+{
+	if (send_buffer && setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
+				&send_buffer, sizeof(send_buffer)) == -1)
+		perror("setsockopt");
+}
+
+void udp_send_set_buffer(int size)
+{
+	send_buffer = size;
+}
+
+void udp_send_set_source(int sock)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(sock, (struct sockaddr*) &addr, &len) == -1) {
+		perror("getsockname");
+		return;
+	}
+
+	set_send_buffer(sock);
+
+	/*
+	 * A socket created before this call is left open, since another thread
+	 * may still be sending on it.
+	 */
+	pthread_mutex_lock(&send_lock);
+	__atomic_store_n(send_sock(addr.ss_family), sock, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&send_lock);
+}
+
+/*
+ * Returns the socket to send datagrams for the given address family from, or
+ * -1 with errno set if it could not be created.
+ */
+static int udp_send_socket(sa_family_t family)
+{
+	int *sock = send_sock(family);
+	int rv;
+
+	if ((rv = __atomic_load_n(sock, __ATOMIC_ACQUIRE)) != -1)
+		return rv;
+
+	pthread_mutex_lock(&send_lock);
+	if ((rv = *sock) == -1) {
+		rv = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+		if (rv != -1) {
+			set_send_buffer(rv);
+			__atomic_store_n(sock, rv, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&send_lock);
+	return rv;
+}
+
 ssize_t tcp_send_bytes(int sock, const char *buf, size_t len)
 {
 	size_t bsent;
@@ -43,6 +119,51 @@ ssize_t tcp_send_bytes(int sock, const char *buf, size_t len)
 	return bsent;
 }
 
+/*
+ * Sends a vector of buffers, at most IOV_MAX per system call.  The contents of
+ * `iov' are not preserved.  Returns the number of bytes sent, or a negative
+ * error number.
+ */
+ssize_t tcp_send_iov(int sock, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg = { 0 };
+	size_t bsent;
+	ssize_t rv;
+
+	bsent = 0;
+	while (iovcnt > 0) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		rv = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (rv == -1)
+			return -errno;
+		bsent += rv;
+
+		/* skip what was sent, and resume within a partly sent buffer */
+		while (iovcnt > 0 && (size_t) rv >= iov->iov_len) {
+			rv -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*) iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+	return bsent;
+}
+
+void tcp_send_set_cork(int on)
+{
+	send_cork = on;
+}
+
+void tcp_cork(int sock, int on)
+{
+	if (send_cork)
+		setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+}
+
 ssize_t tcp_sendf(int sock, size_t size, const char *fmt, ...)
 {
 	char buf[size];
@@ -72,38 +193,128 @@ ssize_t tcp_read_bytes(int sock, char *msg_buf, size_t bytes)
 	return bread;
 }
 
-ssize_t tcp_read_msg(int sock, char *buf, size_t len)
+void tcp_reader_init(struct tcp_reader *r, int sock)
 {
-	size_t i;
+	r->sock = sock;
+	r->start = 0;
+	r->end = 0;
+	r->scan = 0;
+}
 
-	/* delimiter-matching state */
-	struct {
-		const char * const str;
-		const size_t len;
-		size_t pos;
-	} delim = { "\r\n\r\n", 4, 0 };
+/*
+ * Reads as much as is available (and fits) into the reader's buffer.  Returns
+ * the number of bytes read, 0 if the connection was closed, or a negative
+ * error number.
+ */
+ssize_t tcp_reader_fill(struct tcp_reader *r, int flags)
+{
+	ssize_t rv;
 
-	for (i = 0; i < len && delim.pos < delim.len; i++) {
-		signed char c;
-		ssize_t rv;
+	/* make room at the end of the buffer for at least one message */
+	if (r->start == r->end) {
+		r->start = r->end = r->scan = 0;
+	} else if (r->start && sizeof(r->buf) - r->end < MSG_MAX) {
+		memmove(r->buf, r->buf + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->scan -= r->start;
+		r->start = 0;
+	}
 
-		rv = recv(sock, &c, 1, 0);
-		if (rv == -1)
-			return -errno;
-		if (rv == 0)
-			return 0;
+	rv = recv(r->sock, r->buf + r->end, sizeof(r->buf) - r->end, flags);
+	if (rv == -1)
+		return -errno;
+	r->end += rv;
+	return rv;
+}
+
+/*
+ * Finds the first "\r\n\r\n" in the buffered data, or returns NULL.  Bytes
+ * which cannot begin a delimiter are not searched again.
+ */
+static char *find_delim(struct tcp_reader *r)
+{
+	char *p = r->buf + r->scan;
+	char *end = r->buf + r->end;
+
+	while ((p = memchr(p, '\r', end - p))) {
+		if (end - p < 4)
+			break;
+		if (!memcmp(p, "\r\n\r\n", 4))
+			return p;
+		p++;
+	}
+	r->scan = p ? (size_t) (p - r->buf) : r->end;
+	return NULL;
+}
+
+/*
+ * Takes the next message (up to and including its delimiter) from the buffer,
+ * without reading from the socket.  At most `len' - 1 bytes are returned, and
+ * the result is NUL-terminated; a message too long to fit is returned in
+ * pieces.  Returns the length of the message, or 0 if no complete message is
+ * buffered.
+ */
+ssize_t tcp_reader_next(struct tcp_reader *r, char *buf, size_t len)
+{
+	char *delim = find_delim(r);
+	size_t n;
 
-		if (c == delim.str[delim.pos])
-			delim.pos++;
-		else
-			delim.pos = 0;
+	if (delim)
+		n = delim + 4 - (r->buf + r->start);
+	else if (r->end - r->start >= len - 1)
+		n = len - 1;
+	else
+		return 0;
 
-		buf[i] = c;
+	if (n > len - 1)
+		n = len - 1;
+
+	memcpy(buf, r->buf + r->start, n);
+	buf[n] = '\0';
+	r->start += n;
+	if (r->scan < r->start)
+		r->scan = r->start;
+	return n;
+}
+
+/*
+ * Reads a message, blocking until one is complete.  Returns as
+ * tcp_reader_next(), or 0 if the connection was closed, or a negative error
+ * number.
+ */
+ssize_t tcp_reader_msg(struct tcp_reader *r, char *buf, size_t len)
+{
+	ssize_t rv;
+
+	for (;;) {
+		if ((rv = tcp_reader_next(r, buf, len)))
+			return rv;
+		if ((rv = tcp_reader_fill(r, 0)) <= 0)
+			return rv;
 	}
+}
+
+/*
+ * Reads `bytes' bytes, or until the connection is closed, starting with any
+ * buffered data.  Whatever is not buffered is read directly into `buf'.
+ */
+ssize_t tcp_reader_bytes(struct tcp_reader *r, char *buf, size_t bytes)
+{
+	size_t n = r->end - r->start;
+	ssize_t rv;
+
+	if (n > bytes)
+		n = bytes;
+	memcpy(buf, r->buf + r->start, n);
+	r->start += n;
+	if (r->scan < r->start)
+		r->scan = r->start;
 
-	if (i < len)
-		buf[i] = '\0';
-	return i;
+	if (n == bytes)
+		return n;
+	if ((rv = tcp_read_bytes(r->sock, buf + n, bytes - n)) < 0)
+		return rv;
+	return n + rv;
 }
 
 int udp_send(const struct sockaddr *addr, size_t len, const char *msg)
@@ -111,15 +322,13 @@ int udp_send(const struct sockaddr *addr, size_t len, const char *msg)
 	int sock, rc;
 	socklen_t sin_size = get_sockaddr_size(addr);
 
-	sock = socket(addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
-	if (sock == -1)
+	if ((sock = udp_send_socket(addr->sa_family)) == -1)
 		return -errno;
 
 	rc = sendto(sock, msg, len, 0, addr, sin_size);
 	if (rc == -1)
 		rc = -errno;
 
-	close(sock);
 	return rc;
 }
 
@@ -135,3 +344,146 @@ int udp_sendf(const struct sockaddr *addr, size_t size, const char *fmt, ...)
 
 	return udp_send(addr, len, msg);
 }
+
+void udp_fanout_init(struct udp_fanout *fo, const char *msg, size_t len)
+{
+	fo->msg = msg;
+	fo->len = len;
+	fo->nr_dests = 0;
+	fo->max_dests = 0;
+	fo->dests = NULL;
+	fo->sent = 0;
+	fo->failed = 0;
+}
+
+void udp_fanout_free(struct udp_fanout *fo)
+{
+	free(fo->dests);
+}
+
+/*
+ * Adds a destination.  If there is no memory for it, the destination is
+ * counted as failed.
+ */
+void udp_fanout_add(struct udp_fanout *fo, const struct sockaddr *addr)
+{
+	struct sockaddr_storage *dests;
+	unsigned int max;
+
+	if (fo->nr_dests == fo->max_dests) {
+		max = fo->max_dests ? fo->max_dests * 2 : 64;
+		if (!(dests = realloc(fo->dests, max * sizeof(*dests)))) {
+			perror("realloc");
+			fo->failed++;
+			return;
+		}
+		fo->dests = dests;
+		fo->max_dests = max;
+	}
+	memcpy(&fo->dests[fo->nr_dests++], addr, get_sockaddr_size(addr));
+}
+
+/* datagrams per sendmmsg() call, which takes at most UIO_MAXIOV (1024) */
+#define FANOUT_BATCH 256
+
+/*
+ * Sends the first `n' prepared headers.  sendmmsg() stops at the first
+ * destination it fails to send to; that destination is counted as failed and
+ * skipped, and sending resumes with the next one.
+ */
+static void fanout_flush(struct udp_fanout *fo, int sock,
+		struct mmsghdr *hdrs, unsigned int n)
+{
+	unsigned int done = 0;
+	int rc;
+
+	while (done < n) {
+		rc = sendmmsg(sock, hdrs + done, n - done, 0);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+#ifdef PSNETLOG
+			char addr[INET6_ADDRSTRLEN];
+			struct sockaddr *sa = hdrs[done].msg_hdr.msg_name;
+			inet_ntop(sa->sa_family, get_in_addr(sa), addr,
+					sizeof addr);
+			fprintf(stderr, "sendmmsg: %s %d: %s\n", addr,
+					ntohs(get_in_port(sa)), strerror(errno));
+#endif
+			fo->failed++;
+			done++;
+			continue;
+		}
+		fo->sent += rc;
+		done += rc;
+	}
+}
+
+/*
+ * Sends the datagram to every destination in the given address family.
+ */
+static void fanout_send_family(struct udp_fanout *fo, sa_family_t family,
+		struct mmsghdr *hdrs)
+{
+	struct iovec iov = { .iov_base = (char*) fo->msg, .iov_len = fo->len };
+	unsigned int i, n = 0;
+	int sock;
+
+	for (i = 0; i < fo->nr_dests; i++)
+		if (fo->dests[i].ss_family == family)
+			n++;
+	if (!n)
+		return;
+
+	if ((sock = udp_send_socket(family)) == -1) {
+		fo->failed += n;
+		return;
+	}
+
+	for (i = 0, n = 0; i < fo->nr_dests; i++) {
+		struct sockaddr *addr = (struct sockaddr*) &fo->dests[i];
+
+		if (addr->sa_family != family)
+			continue;
+
+		memset(&hdrs[n], 0, sizeof(hdrs[n]));
+		hdrs[n].msg_hdr.msg_name = addr;
+		hdrs[n].msg_hdr.msg_namelen = get_sockaddr_size(addr);
+		hdrs[n].msg_hdr.msg_iov = &iov;
+		hdrs[n].msg_hdr.msg_iovlen = 1;
+
+		if (++n == FANOUT_BATCH) {
+			fanout_flush(fo, sock, hdrs, n);
+			n = 0;
+		}
+	}
+
+	if (n)
+		fanout_flush(fo, sock, hdrs, n);
+}
+
+/*
+ * Sends the datagram to every destination added to the fanout.  Returns the
+ * number of destinations which could not be sent to, including any which
+ * could not be added.
+ */
+int udp_fanout_send(struct udp_fanout *fo)
+{
+	struct mmsghdr *hdrs;
+
+	if (!fo->nr_dests)
+		return fo->failed;
+
+	hdrs = malloc((fo->nr_dests < FANOUT_BATCH ? fo->nr_dests :
+				FANOUT_BATCH) * sizeof(struct mmsghdr));
+	if (!hdrs) {
+		perror("malloc");
+		fo->failed += fo->nr_dests;
+		return fo->failed;
+	}
+	fanout_send_family(fo, AF_INET, hdrs);
+	fanout_send_family(fo, AF_INET6, hdrs);
+	free(hdrs);
+
+	return fo->failed;
+}
@@ -16,11 +16,13 @@
  * libpsnet.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#define _GNU_SOURCE /* IOV_MAX */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h> /* IOV_MAX */
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -39,24 +41,33 @@ ssize_t psnet_request(PSNET *ent, char **resp, size_t len, const char *msg)
 	size_t r_size;
 	ssize_t rv;
 	char hdr[HDR_MAX];
+	struct tcp_reader reader;
 	struct sockaddr *addr = (struct sockaddr*) &ent->addr;
+	struct timeval tv = { .tv_sec = PSNET_REQUEST_TIMEOUT, .tv_usec = 0 };
 
 	if ((sock = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP)) == -1)
 		return -errno;
 
-	if (connect(sock, addr, get_sockaddr_size(addr)) == -1)
+	/* the send timeout also bounds connect() */
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+	if (connect(sock, addr, get_sockaddr_size(addr)) == -1) {
 		rv = -errno;
 		goto cleanup;
+	}
 
 	if ((rv = tcp_send_bytes(sock, msg, len)) < 0)
 		goto cleanup;
 
-	if ((rv = tcp_read_msg(sock, hdr, HDR_MAX)) <= 0)
+	tcp_reader_init(&reader, sock);
+	if ((rv = tcp_reader_msg(&reader, hdr, HDR_MAX)) <= 0)
 		goto cleanup;
 
-	if (rv == HDR_MAX) {
+	/* a header too long for the buffer comes back without its delimiter */
+	if (rv < 4 || memcmp(hdr + rv - 4, "\r\n\r\n", 4)) {
 		rv = -EBADMSG;
-        	goto cleanup;
+		goto cleanup;
 	}
 
 	if ((rv = parse_header(&r_status, &r_size, hdr)) == -1) {
@@ -70,7 +81,7 @@ ssize_t psnet_request(PSNET *ent, char **resp, size_t len, const char *msg)
 	}
 
 	*resp = malloc(r_size + 1);
-	if ((rv = tcp_read_bytes(sock, *resp, r_size)) == -1) {
+	if ((rv = tcp_reader_bytes(&reader, *resp, r_size)) < 0) {
 		free (*resp);
 		goto cleanup;
 	}
@@ -145,18 +156,33 @@ int psnet_request_ping(PSNET *ent)
 	return psnet_request(ent, NULL, 21, "{\"method\":\"ping\"}\r\n\r\n");
 }
 
+/*
+ * Sends a response built from response_nodes, gathering up to IOV_MAX nodes
+ * into each system call.
+ */
 int psnet_send_response(int sock, struct list_head *head)
 {
+	struct iovec iov[IOV_MAX];
 	struct list_head *pos;
-	ssize_t rv;
+	ssize_t rv = 0;
+	int n = 0;
 
+	tcp_cork(sock, 1);
 	list_for_each(pos, head) {
 		struct response_node *node = (struct response_node*) pos;
-		rv = tcp_send_bytes(sock, node->data, node->len);
-		if (rv < 0)
-			return rv;
+		iov[n].iov_base = node->data;
+		iov[n].iov_len = node->len;
+		if (++n == IOV_MAX) {
+			if ((rv = tcp_send_iov(sock, iov, n)) < 0)
+				goto out;
+			n = 0;
+		}
 	}
-	return 0;
+	if (n)
+		rv = tcp_send_iov(sock, iov, n);
+out:
+	tcp_cork(sock, 0);
+	return rv < 0 ? rv : 0;
 }
 
 void psnet_send_error(int sock, int no, const char *str)
@@ -0,0 +1,309 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Event-driven TCP server: instead of parking a thread on every connection,
+ * a fixed number of event loops wait on epoll for readable sockets, buffer
+ * whatever has arrived in a tcp_reader, and hand each complete request to a
+ * dispatch function.
+ *
+ * Reads never block, but handlers still write their responses with blocking
+ * sends (tcp_send_iov() and friends) on the loop's own thread.  Replies are
+ * small and almost always fit in the socket's send buffer; when they do not,
+ * because the client is not reading, the whole loop waits for the send to
+ * complete or for SO_SNDTIMEO to expire.  The send timeout is therefore kept
+ * much shorter than the idle timeout, SEND_TIMEOUT seconds, which bounds how
+ * long one slow reader can stall the other connections on its loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "msgpool.h"
+#include "network.h"
+#include "server.h"
+
+#define CONN_TIMEOUT 30 /* seconds of inactivity before a connection is closed */
+#define SEND_TIMEOUT 1  /* seconds a blocked response may stall its loop */
+#define MAX_EVENTS 64
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+struct connection {
+	struct list_head chain; /* position in the loop's connection list */
+	time_t last_active;
+	struct tcp_reader reader;
+	struct msg_info *mi;
+};
+
+struct event_loop {
+	int epfd;
+	int cpu;                /* CPU to pin the loop to, or -1 */
+	int nr_listeners;
+	struct server_shard **listeners;
+	struct list_head conns; /* connections, least recently active first */
+};
+
+static int (*dispatch)(struct msg_info*);
+static int max_conns;
+static int nr_conns;
+
+static time_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static void close_connection(struct connection *conn)
+{
+	close(conn->mi->sock);
+	list_del(&conn->chain);
+	__sync_fetch_and_sub(&nr_conns, 1);
+#ifdef PSNETLOG
+	printf("D %s\n", conn->mi->paddr);
+#endif
+	msgpool_put(conn->mi);
+	free(conn);
+}
+
+/*
+ * Accepts pending connections on a listening socket.
+ */
+static void accept_connections(struct event_loop *loop,
+		struct server_shard *shard)
+{
+	struct timeval tv = { .tv_sec = SEND_TIMEOUT, .tv_usec = 0 };
+	struct epoll_event ev;
+	struct connection *conn;
+	struct sockaddr_storage addr;
+	socklen_t sin_size;
+	int sock;
+
+	for (int i = 0; i < MAX_EVENTS; i++) {
+		sin_size = sizeof(addr);
+		sock = accept(shard->sock, (struct sockaddr*) &addr, &sin_size);
+		if (sock == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		__atomic_add_fetch(&shard->count, 1, __ATOMIC_RELAXED);
+
+		if (__sync_fetch_and_add(&nr_conns, 1) >= max_conns) {
+			fprintf(stderr, "connection limit reached; "
+					"refusing connection\n");
+			__sync_fetch_and_sub(&nr_conns, 1);
+			close(sock);
+			continue;
+		}
+
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*) &tv,
+				sizeof(tv));
+
+		conn = malloc(sizeof(struct connection));
+		if (!conn || !(conn->mi = msgpool_get())) {
+			fprintf(stderr, "message pool exhausted; refusing "
+					"connection\n");
+			__sync_fetch_and_sub(&nr_conns, 1);
+			close(sock);
+			free(conn);
+			continue;
+		}
+		tcp_reader_init(&conn->reader, sock);
+		conn->last_active = now();
+		conn->mi->sock = sock;
+		conn->mi->socktype = SOCK_STREAM;
+		conn->mi->addr = addr;
+
+#ifdef PSNETLOG
+		inet_ntop(addr.ss_family, get_in_addr((struct sockaddr*) &addr),
+				conn->mi->paddr, sizeof conn->mi->paddr);
+		printf("C %s\n", conn->mi->paddr);
+#endif
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = conn;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+			perror("epoll_ctl");
+			__sync_fetch_and_sub(&nr_conns, 1);
+			close(sock);
+			msgpool_put(conn->mi);
+			free(conn);
+			continue;
+		}
+		list_add_tail(&conn->chain, &loop->conns);
+	}
+}
+
+/*
+ * Reads whatever is available on a connection and dispatches any complete
+ * requests.  Returns -1 if the connection should be closed.
+ */
+static int service_connection(struct event_loop *loop,
+		struct connection *conn)
+{
+	ssize_t rv;
+
+	rv = tcp_reader_fill(&conn->reader, MSG_DONTWAIT);
+	if (rv == -EAGAIN || rv == -EWOULDBLOCK)
+		return 0;
+	if (rv <= 0)
+		return -1; /* error, or connection closed by client */
+
+	conn->last_active = now();
+	list_move_tail(&conn->chain, &loop->conns);
+
+	while ((rv = tcp_reader_next(&conn->reader, conn->mi->msg, MSG_MAX))) {
+		conn->mi->len = rv;
+		if (dispatch(conn->mi))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Closes connections which have been idle for longer than CONN_TIMEOUT.
+ */
+static void expire_connections(struct event_loop *loop)
+{
+	struct connection *conn, *next;
+	time_t deadline = now() - CONN_TIMEOUT;
+
+	list_for_each_entry_safe(conn, next, &loop->conns, chain) {
+		if (conn->last_active > deadline)
+			break;
+		close_connection(conn);
+	}
+}
+
+static _Noreturn void *event_loop(void *data)
+{
+	struct event_loop *loop = data;
+	struct epoll_event events[MAX_EVENTS];
+	int n;
+
+	if (loop->cpu >= 0)
+		server_pin_thread(loop->cpu);
+
+	for (;;) {
+		n = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000);
+		if (n == -1 && errno != EINTR)
+			perror("epoll_wait");
+
+		for (int i = 0; i < n; i++) {
+			struct connection *conn = events[i].data.ptr;
+
+			if (!conn) {
+				for (int j = 0; j < loop->nr_listeners; j++)
+					accept_connections(loop,
+							loop->listeners[j]);
+			} else if (service_connection(loop, conn))
+				close_connection(conn);
+		}
+
+		expire_connections(loop);
+	}
+}
+
+/*
+ * Registers a listening socket with an event loop.
+ */
+static void event_loop_listen(struct event_loop *loop,
+		struct server_shard *shard)
+{
+	struct epoll_event ev;
+
+	if (fcntl(shard->sock, F_SETFL,
+				fcntl(shard->sock, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		exit(EXIT_FAILURE);
+	}
+
+	/* loops may share a socket; EPOLLEXCLUSIVE avoids waking all of them */
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shard->sock, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	loop->listeners[loop->nr_listeners++] = shard;
+}
+
+/*
+ * Sets up loop `n' of `nr_loops'.  Every listening socket is assigned to at
+ * least one loop: with more sockets than loops each loop takes several, and
+ * with fewer, loops share them.
+ */
+static void event_loop_init(struct event_loop *loop, int n, int nr_loops,
+		struct server_shard *shards, int nr_shards, int pin)
+{
+	if ((loop->epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	loop->cpu = pin ? n : -1;
+	loop->nr_listeners = 0;
+	loop->listeners = malloc(nr_shards * sizeof(struct server_shard*));
+	INIT_LIST_HEAD(&loop->conns);
+
+	if (nr_shards < nr_loops) {
+		event_loop_listen(loop, &shards[n % nr_shards]);
+		return;
+	}
+	for (int i = n; i < nr_shards; i += nr_loops)
+		event_loop_listen(loop, &shards[i]);
+}
+
+_Noreturn void tcp_reactor_main(struct server_shard *shards, int nr_shards,
+		const struct server_opts *opts, int max,
+		int (*cb)(struct msg_info*))
+{
+	struct event_loop *loops;
+	int nr_loops = opts->event_loops;
+	pthread_t tid;
+
+	dispatch = cb;
+	max_conns = max;
+
+	loops = malloc(nr_loops * sizeof(struct event_loop));
+	for (int i = 0; i < nr_loops; i++)
+		event_loop_init(&loops[i], i, nr_loops, shards, nr_shards,
+				opts->pin_shards && nr_shards > 1);
+
+	/* the calling thread runs the first loop */
+	for (int i = 1; i < nr_loops; i++) {
+		if (pthread_create(&tid, NULL, event_loop, &loops[i]))
+			perror("pthread_create");
+		else
+			pthread_detach(tid);
+	}
+	event_loop(&loops[0]);
+}
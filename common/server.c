@@ -16,11 +16,15 @@
  * libpsnet.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#define _GNU_SOURCE /* recvmmsg, ppoll, pthread_setaffinity_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h> /* IOV_MAX */
 #include <string.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -29,7 +33,9 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include <sched.h>
 
+#include "msgpool.h"
 #include "network.h"
 #include "server.h"
 
@@ -37,7 +43,164 @@
 
 #define LOG_FILE_PATH "/tmp/p2pservlog"
 
-int tcp_server_init(char *port)
+int num_threads;
+pthread_mutex_t num_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct server_shard tcp_shards[SERVER_MAX_SHARDS];
+static struct server_shard udp_shards[SERVER_MAX_SHARDS];
+static int nr_tcp_shards;
+static int nr_udp_shards;
+
+int server_ini_handler(struct server_opts *opts, const char *file,
+		const char *name, const char *value)
+{
+	int val;
+
+	if (!strcmp(name, "tcp-model")) {
+		if (!strcmp(value, "threads"))
+			opts->tcp_model = TCP_THREADS;
+		else if (!strcmp(value, "epoll"))
+			opts->tcp_model = TCP_EPOLL;
+		else
+			printf("%s: error: tcp-model must be 'threads' or "
+					"'epoll'\n", file);
+	} else if (!strcmp(name, "event-loops")) {
+		if ((val = atoi(value)) < 1)
+			printf("%s: error: event-loops must be a positive "
+					"integer\n", file);
+		else
+			opts->event_loops = val;
+	} else if (!strcmp(name, "listen-shards")) {
+		if (!strcmp(value, "auto"))
+			val = sysconf(_SC_NPROCESSORS_ONLN);
+		else
+			val = atoi(value);
+		if (val < 1)
+			printf("%s: error: listen-shards must be a positive "
+					"integer or 'auto'\n", file);
+		else
+			opts->listen_shards = val < SERVER_MAX_SHARDS ? val :
+				SERVER_MAX_SHARDS;
+	} else if (!strcmp(name, "pin-shards")) {
+		if (!strcmp(value, "yes"))
+			opts->pin_shards = 1;
+		else if (!strcmp(value, "no"))
+			opts->pin_shards = 0;
+		else
+			printf("%s: error: pin-shards must be 'yes' or 'no'\n",
+					file);
+	} else if (!strcmp(name, "udp-workers")) {
+		if ((val = atoi(value)) < 1)
+			printf("%s: error: udp-workers must be a positive "
+					"integer\n", file);
+		else
+			opts->udp_workers = val;
+	} else if (!strcmp(name, "udp-queue-depth")) {
+		if ((val = atoi(value)) < 1)
+			printf("%s: error: udp-queue-depth must be a positive "
+					"integer\n", file);
+		else
+			opts->udp_queue_depth = val;
+	} else if (!strcmp(name, "udp-overflow")) {
+		if (!strcmp(value, "drop-newest"))
+			opts->udp_overflow = UDP_DROP_NEWEST;
+		else if (!strcmp(value, "drop-oldest"))
+			opts->udp_overflow = UDP_DROP_OLDEST;
+		else if (!strcmp(value, "block"))
+			opts->udp_overflow = UDP_BLOCK;
+		else
+			printf("%s: error: udp-overflow must be 'drop-newest', "
+					"'drop-oldest' or 'block'\n", file);
+	} else if (!strcmp(name, "udp-batch")) {
+		if ((val = atoi(value)) < 1 || val > IOV_MAX)
+			printf("%s: error: udp-batch must be between 1 and "
+					"%d\n", file, IOV_MAX);
+		else
+			opts->udp_batch = val;
+	} else if (!strcmp(name, "send-buffer")) {
+		if ((val = atoi(value)) < 0)
+			printf("%s: error: send-buffer must be a non-negative "
+					"integer\n", file);
+		else
+			opts->send_buffer = val;
+	} else if (!strcmp(name, "send-from-listen-port")) {
+		if (!strcmp(value, "yes"))
+			opts->send_from_listen = 1;
+		else if (!strcmp(value, "no"))
+			opts->send_from_listen = 0;
+		else
+			printf("%s: error: send-from-listen-port must be 'yes' "
+					"or 'no'\n", file);
+	} else if (!strcmp(name, "tcp-cork")) {
+		if (!strcmp(value, "yes"))
+			opts->tcp_cork = 1;
+		else if (!strcmp(value, "no"))
+			opts->tcp_cork = 0;
+		else
+			printf("%s: error: tcp-cork must be 'yes' or 'no'\n",
+					file);
+	} else if (!strcmp(name, "msg-pool-size")) {
+		if ((val = atoi(value)) < 1)
+			printf("%s: error: msg-pool-size must be a positive "
+					"integer\n", file);
+		else
+			opts->msg_pool_size = val;
+	} else if (!strcmp(name, "udp-batch-wait")) {
+		if ((val = atoi(value)) < 0)
+			printf("%s: error: udp-batch-wait must be a "
+					"non-negative integer\n", file);
+		else
+			opts->udp_batch_wait = val;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+static int shards_json(char *buf, size_t len, struct server_shard *shards,
+		int n)
+{
+	size_t pos = 0;
+
+	for (int i = 0; i < n && pos < len; i++)
+		pos += snprintf(buf + pos, len - pos, "%s%lu", i ? "," : "",
+				__atomic_load_n(&shards[i].count,
+					__ATOMIC_RELAXED));
+	return pos;
+}
+
+int server_stats_json(char *buf, size_t len)
+{
+	struct udp_stats udp;
+	struct msgpool_stats pool;
+	char tcp_counts[SERVER_STATS_STRLEN / 2];
+	char udp_counts[SERVER_STATS_STRLEN / 2];
+
+	udp_server_stats(&udp);
+	msgpool_stats(&pool);
+	shards_json(tcp_counts, sizeof tcp_counts, tcp_shards, nr_tcp_shards);
+	shards_json(udp_counts, sizeof udp_counts, udp_shards, nr_udp_shards);
+
+	return snprintf(buf, len, "\"udp-received\":%lu,\"udp-dropped\":%lu,"
+			"\"udp-shards\":[%s],\"tcp-shards\":[%s],"
+			"\"pool-size\":%zu,\"pool-hits\":%lu,"
+			"\"pool-misses\":%lu,\"pool-exhausted\":%lu",
+			udp.received, udp.dropped, udp_counts, tcp_counts,
+			pool.capacity, pool.hits, pool.misses, pool.exhausted);
+}
+
+void server_pin_thread(int n)
+{
+	cpu_set_t set;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	CPU_ZERO(&set);
+	CPU_SET(n % (nr_cpus > 0 ? nr_cpus : 1), &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof set, &set))
+		fprintf(stderr, "failed to pin thread to CPU %d\n", n);
+}
+
+int tcp_server_init(char *port, int reuseport)
 {
 	struct addrinfo hints, *servinfo, *p;
 	const int yes = 1;
@@ -68,6 +231,12 @@ int tcp_server_init(char *port)
 			exit(EXIT_FAILURE);
 		}
 
+		if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+					&yes, sizeof(int)) == -1) {
+			perror("tcpserver: setsockopt");
+			exit(EXIT_FAILURE);
+		}
+
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			close(sockfd);
 			perror("tcpserver: bind");
@@ -92,34 +261,83 @@ int tcp_server_init(char *port)
 	return sockfd;
 }
 
-_Noreturn void tcp_server_main(int sock, int max_threads, void*(*cb)(void*))
+static int (*tcp_dispatch)(struct msg_info*);
+static int tcp_max_conns;
+
+/*
+ * Services a TCP connection in its own thread.
+ */
+static void *tcp_connection_thread(void *data)
+{
+	struct msg_info *mi = data;
+	struct tcp_reader reader;
+	ssize_t len;
+
+	tcp_reader_init(&reader, mi->sock);
+
+	for(;;) {
+
+		if ((len = tcp_reader_msg(&reader, mi->msg, MSG_MAX)) <= 0)
+			break; /* connection closed by client */
+		mi->len = len;
+
+		if (tcp_dispatch(mi))
+			break;
+	}
+
+	/* clean up */
+	close(mi->sock);
+	pthread_mutex_lock(&num_threads_lock);
+	num_threads--;
+	pthread_mutex_unlock(&num_threads_lock);
+#ifdef PSNETLOG
+	printf("D %s\n", mi->paddr);
+#endif
+	msgpool_put(mi);
+	pthread_exit(NULL);
+}
+
+/*
+ * Accepts connections on a listening socket, starting a thread for each.
+ */
+static _Noreturn void *tcp_accept_loop(void *data)
 {
+	struct server_shard *shard = data;
+	struct sockaddr_storage addr;
 	socklen_t sin_size;
 	struct msg_info *targ;
 	pthread_t tid;
+	int sock;
 
 	struct timeval tv = { .tv_sec = 30, .tv_usec = 0 };
 
 	for (;;) {
 
-		targ = malloc(sizeof(struct msg_info));
-
 		/* wait for a connection */
-		sin_size = sizeof(targ->addr);
-		targ->sock = accept(sock, (struct sockaddr*) &targ->addr, &sin_size);
-		if (targ->sock == -1) {
+		sin_size = sizeof(addr);
+		sock = accept(shard->sock, (struct sockaddr*) &addr, &sin_size);
+		if (sock == -1) {
 			perror("accept");
-			free(targ);
 			continue;
 		}
+		__atomic_add_fetch(&shard->count, 1, __ATOMIC_RELAXED);
+
+		if (!(targ = msgpool_get())) {
+			fprintf(stderr, "message pool exhausted; refusing "
+					"connection\n");
+			close(sock);
+			continue;
+		}
+		targ->sock = sock;
+		targ->addr = addr;
 
 		/* close connection if thread limit reached */
 		pthread_mutex_lock(&num_threads_lock);
-		if (num_threads >= max_threads) {
+		if (num_threads >= tcp_max_conns) {
 			fprintf(stderr, "thread limit reached; refusing connection\n");
 			pthread_mutex_unlock(&num_threads_lock);
 			close(targ->sock);
-			free(targ);
+			msgpool_put(targ);
 			continue;
 		}
 
@@ -128,6 +346,7 @@ _Noreturn void tcp_server_main(int sock, int max_threads, void*(*cb)(void*))
 
 		setsockopt(targ->sock, SOL_SOCKET, SO_RCVTIMEO, (char*) &tv,
 				sizeof(tv));
+		targ->socktype = SOCK_STREAM;
 
 #ifdef PSNETLOG
 		inet_ntop(targ->addr.ss_family,
@@ -136,14 +355,50 @@ _Noreturn void tcp_server_main(int sock, int max_threads, void*(*cb)(void*))
 		printf("C %s\n", targ->paddr);
 #endif
 		/* create a new thread to service the connection */
-		if (pthread_create(&tid, NULL, cb, targ))
+		if (pthread_create(&tid, NULL, tcp_connection_thread, targ)) {
+			perror("pthread_create");
+			close(targ->sock);
+			msgpool_put(targ);
+			pthread_mutex_lock(&num_threads_lock);
+			num_threads--;
+			pthread_mutex_unlock(&num_threads_lock);
+		} else {
+			pthread_detach(tid);
+		}
+	}
+}
+
+_Noreturn void tcp_server_main(char *port, const struct server_opts *opts,
+		int max_conns, int (*dispatch)(struct msg_info*))
+{
+	pthread_t tid;
+
+	tcp_dispatch = dispatch;
+	tcp_max_conns = max_conns;
+	tcp_send_set_cork(opts->tcp_cork);
+
+	nr_tcp_shards = opts->listen_shards;
+	for (int i = 0; i < nr_tcp_shards; i++)
+		tcp_shards[i].sock = tcp_server_init(port, nr_tcp_shards > 1);
+
+	if (opts->tcp_model == TCP_EPOLL)
+		tcp_reactor_main(tcp_shards, nr_tcp_shards, opts, max_conns,
+				dispatch);
+
+	/*
+	 * Acceptor threads aren't pinned: connection threads would inherit
+	 * their affinity.
+	 */
+	for (int i = 1; i < nr_tcp_shards; i++) {
+		if (pthread_create(&tid, NULL, tcp_accept_loop, &tcp_shards[i]))
 			perror("pthread_create");
 		else
 			pthread_detach(tid);
 	}
+	tcp_accept_loop(&tcp_shards[0]);
 }
 
-int udp_server_init(char *port)
+int udp_server_init(char *port, int reuseport)
 {
 	struct addrinfo hints, *servinfo, *p;
 	const int yes = 1;
@@ -173,6 +428,12 @@ int udp_server_init(char *port)
 			exit(EXIT_FAILURE);
 		}
 
+		if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+					&yes, sizeof(int)) == -1) {
+			perror("setsockopt");
+			exit(EXIT_FAILURE);
+		}
+
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			close(sockfd);
 			perror("bind");
@@ -189,54 +450,351 @@ int udp_server_init(char *port)
 
 	freeaddrinfo(servinfo);
 
-	num_threads = 0;
-	pthread_mutex_init(&num_threads_lock, NULL);
-
 	return sockfd;
 }
 
-_Noreturn void udp_server_main(int sock, int max_threads, void *(*cb)(void*))
+/*
+ * Bounded queue of datagrams waiting for a worker.
+ */
+static struct udp_queue {
+	struct msg_info **ring;
+	unsigned int depth;
+	unsigned int head;   /* index of the oldest element */
+	unsigned int count;  /* number of queued elements */
+	unsigned int workers; /* number of threads dequeueing */
+	enum udp_overflow overflow;
+	struct udp_stats stats;
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+} udp_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.nonempty = PTHREAD_COND_INITIALIZER,
+	.nonfull = PTHREAD_COND_INITIALIZER
+};
+
+static void (*udp_callback)(struct msg_info*);
+static void (*udp_flush)(void);
+static const struct server_opts *udp_opts;
+
+static void udp_queue_init(struct udp_queue *q, const struct server_opts *opts)
 {
-	struct msg_info *msg;
-	socklen_t sin_size;
-	ssize_t rc;
-	pthread_t tid;
+	q->ring = malloc(opts->udp_queue_depth * sizeof(struct msg_info*));
+	q->depth = opts->udp_queue_depth;
+	q->head = 0;
+	q->count = 0;
+	q->overflow = opts->udp_overflow;
+	q->workers = opts->udp_workers;
+}
 
-	for(;;) {
-		msg = malloc(sizeof(struct msg_info));
-		sin_size = sizeof(struct sockaddr_in);
+/*
+ * Adds `n' datagrams to the queue, applying the overflow policy whenever the
+ * queue is full.  Datagrams dropped as a result are stored in `dropped', and
+ * their number is returned.
+ */
+static int udp_enqueue(struct udp_queue *q, struct msg_info **msgs, int n,
+		struct msg_info **dropped)
+{
+	int nr_dropped = 0;
+
+	pthread_mutex_lock(&q->lock);
+	q->stats.received += n;
+
+	for (int i = 0; i < n; i++) {
+		if (q->count == q->depth) {
+			switch (q->overflow) {
+			case UDP_DROP_NEWEST:
+				q->stats.dropped++;
+				dropped[nr_dropped++] = msgs[i];
+				continue;
+			case UDP_DROP_OLDEST:
+				q->stats.dropped++;
+				dropped[nr_dropped++] = q->ring[q->head];
+				q->head = (q->head + 1) % q->depth;
+				q->count--;
+				break;
+			case UDP_BLOCK:
+				pthread_cond_broadcast(&q->nonempty);
+				while (q->count == q->depth)
+					pthread_cond_wait(&q->nonfull, &q->lock);
+				break;
+			}
+		}
 
-		rc = recvfrom(sock, msg->msg, MSG_MAX-1, 0,
-				(struct sockaddr*) &msg->addr, &sin_size);
-		if (rc == -1) {
-			perror("recvfrom");
-			continue;
+		q->ring[(q->head + q->count) % q->depth] = msgs[i];
+		q->count++;
+	}
+
+	pthread_cond_broadcast(&q->nonempty);
+	pthread_mutex_unlock(&q->lock);
+	return nr_dropped;
+}
+
+/*
+ * Takes up to `max' datagrams from the queue, waiting for at least one.  A
+ * worker takes no more than its share of what is queued, so that a burst is
+ * spread across the workers.
+ */
+static int udp_dequeue(struct udp_queue *q, struct msg_info **msgs, int max)
+{
+	unsigned int n;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->count)
+		pthread_cond_wait(&q->nonempty, &q->lock);
+
+	n = (q->count + q->workers - 1) / q->workers;
+	if (n > (unsigned int) max)
+		n = max;
+	for (unsigned int i = 0; i < n; i++) {
+		msgs[i] = q->ring[q->head];
+		q->head = (q->head + 1) % q->depth;
+	}
+	q->count -= n;
+	pthread_cond_broadcast(&q->nonfull);
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+/*
+ * Receives and discards a datagram, for when the message pool is exhausted.
+ * Returns the number of datagrams discarded.
+ */
+static int udp_discard(struct udp_queue *q, struct server_shard *shard)
+{
+	char c;
+
+	if (recv(shard->sock, &c, 1, 0) == -1) {
+		if (errno != EINTR)
+			perror("recv");
+		return 0;
+	}
+	__atomic_add_fetch(&shard->count, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&q->lock);
+	q->stats.received++;
+	q->stats.dropped++;
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+void udp_server_stats(struct udp_stats *stats)
+{
+	pthread_mutex_lock(&udp_queue.lock);
+	*stats = udp_queue.stats;
+	pthread_mutex_unlock(&udp_queue.lock);
+}
+
+/*
+ * Worker thread: services queued datagrams.
+ */
+static _Noreturn void *udp_worker(void *data)
+{
+	struct msg_info **msgs;
+	int n;
+
+	msgs = malloc(udp_opts->udp_batch * sizeof(struct msg_info*));
+	for (;;) {
+		n = udp_dequeue(&udp_queue, msgs, udp_opts->udp_batch);
+		for (int i = 0; i < n; i++) {
+			udp_callback(msgs[i]);
+			msgpool_put(msgs[i]);
 		}
-		msg->msg[rc] = '\0';
-		msg->len = rc;
+		if (udp_flush)
+			udp_flush();
+	}
+}
 
-		pthread_mutex_lock(&num_threads_lock);
-		if (num_threads >= max_threads) {
-			fprintf(stderr, "thread limit reached: discarding message\n");
-			pthread_mutex_unlock(&num_threads_lock);
-			free(msg);
+/*
+ * Receive buffers for recvmmsg().  Slot i receives into msgs[i]; slots whose
+ * messages have been handed off are refilled from the message pool.  Only the
+ * first `ready' slots have buffers: fewer than `size' if the pool runs low.
+ */
+struct udp_batch {
+	int size;
+	int ready;
+	struct mmsghdr *hdrs;
+	struct iovec *iov;
+	struct msg_info **msgs;
+	struct msg_info **dropped;
+};
+
+/*
+ * Replaces the buffers of the first `used' slots, moving the remaining
+ * buffers to the front.
+ */
+static void udp_batch_refill(struct udp_batch *b, int used)
+{
+	struct msg_info *mi;
+
+	b->ready -= used;
+	memmove(b->msgs, b->msgs + used, b->ready * sizeof(struct msg_info*));
+	while (b->ready < b->size && (mi = msgpool_get()))
+		b->msgs[b->ready++] = mi;
+
+	for (int i = 0; i < b->ready; i++) {
+		b->iov[i].iov_base = b->msgs[i]->msg;
+		b->iov[i].iov_len = MSG_MAX-1;
+		b->hdrs[i].msg_hdr.msg_name = &b->msgs[i]->addr;
+		b->hdrs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->hdrs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+static void udp_batch_init(struct udp_batch *b, int size)
+{
+	b->size = size;
+	b->hdrs = calloc(size, sizeof(struct mmsghdr));
+	b->iov = malloc(size * sizeof(struct iovec));
+	b->msgs = malloc(size * sizeof(struct msg_info*));
+	b->dropped = malloc(size * sizeof(struct msg_info*));
+	b->ready = 0;
+	udp_batch_refill(b, 0);
+}
+
+/*
+ * Receives datagrams into the slots from `first' onwards, returning the number
+ * received.  If `wait' is set, blocks until at least one datagram arrives.
+ */
+static int udp_batch_recv(int sock, struct udp_batch *b, int first, int wait)
+{
+	int rc;
+
+	for (int i = first; i < b->ready; i++)
+		b->hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+	rc = recvmmsg(sock, b->hdrs + first, b->ready - first,
+			wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+	if (rc == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			perror("recvmmsg");
+		return 0;
+	}
+	return rc;
+}
+
+/*
+ * Receives a batch of datagrams.  Blocks until at least one arrives, then
+ * keeps collecting for up to `wait_us' microseconds while the batch is not
+ * full.
+ */
+static int udp_batch_fill(int sock, struct udp_batch *b, long wait_us)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	struct timespec deadline, now, left;
+	int n;
+
+	if (!(n = udp_batch_recv(sock, b, 0, 1)) || !wait_us)
+		return n;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += wait_us / 1000000;
+	deadline.tv_nsec += (wait_us % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	while (n < b->ready) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec = deadline.tv_sec - now.tv_sec;
+		left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000;
+		}
+		if (left.tv_sec < 0 || ppoll(&pfd, 1, &left, NULL) < 1)
+			break;
+		n += udp_batch_recv(sock, b, n, 0);
+	}
+	return n;
+}
+
+/*
+ * Receive loop for one UDP socket: reads batches of datagrams and queues them
+ * for the workers.
+ */
+static _Noreturn void *udp_receive_loop(void *data)
+{
+	struct server_shard *shard = data;
+	const struct server_opts *opts = udp_opts;
+	struct udp_batch batch;
+	struct msg_info *msg;
+	int n, nr_dropped, nr_discarded = 0;
+
+	if (opts->pin_shards && nr_udp_shards > 1)
+		server_pin_thread(shard - udp_shards);
+
+	udp_batch_init(&batch, opts->udp_batch);
+
+	for(;;) {
+		if (!batch.ready) {
+			nr_discarded += udp_discard(&udp_queue, shard);
+			udp_batch_refill(&batch, 0);
 			continue;
 		}
+		if (nr_discarded) {
+			fprintf(stderr, "message pool exhausted: discarded %d "
+					"message(s)\n", nr_discarded);
+			nr_discarded = 0;
+		}
 
-		num_threads++;
-		pthread_mutex_unlock(&num_threads_lock);
+		n = udp_batch_fill(shard->sock, &batch, opts->udp_batch_wait);
+		__atomic_add_fetch(&shard->count, n, __ATOMIC_RELAXED);
 
+		for (int i = 0; i < n; i++) {
+			msg = batch.msgs[i];
+			msg->len = batch.hdrs[i].msg_len;
+			msg->msg[msg->len] = '\0';
+			msg->sock = shard->sock;
+			msg->socktype = SOCK_DGRAM;
 #ifdef PSNETLOG
-		inet_ntop(msg->addr.ss_family,
-				get_in_addr((struct sockaddr*) &msg->addr),
-				msg->paddr, sizeof msg->paddr);
-		printf("M %s\n", msg->paddr);
+			inet_ntop(msg->addr.ss_family,
+					get_in_addr((struct sockaddr*) &msg->addr),
+					msg->paddr, sizeof msg->paddr);
+			printf("M %s\n", msg->paddr);
 #endif
+		}
+
+		nr_dropped = udp_enqueue(&udp_queue, batch.msgs, n,
+				batch.dropped);
+		if (nr_dropped)
+			fprintf(stderr, "UDP queue full: discarded %d "
+					"message(s)\n", nr_dropped);
+		for (int i = 0; i < nr_dropped; i++)
+			msgpool_put(batch.dropped[i]);
+
+		udp_batch_refill(&batch, n);
+	}
+}
+
+_Noreturn void udp_server_main(char *port, const struct server_opts *opts,
+		void (*cb)(struct msg_info*), void (*flush)(void))
+{
+	pthread_t tid;
+
+	udp_callback = cb;
+	udp_flush = flush;
+	udp_opts = opts;
+	udp_queue_init(&udp_queue, opts);
+	for (int i = 0; i < opts->udp_workers; i++) {
+		if (pthread_create(&tid, NULL, udp_worker, NULL))
+			perror("pthread_create");
+		else
+			pthread_detach(tid);
+	}
+
+	nr_udp_shards = opts->listen_shards;
+	for (int i = 0; i < nr_udp_shards; i++)
+		udp_shards[i].sock = udp_server_init(port, nr_udp_shards > 1);
+	if (opts->send_from_listen)
+		udp_send_set_source(udp_shards[0].sock);
 
-		if (pthread_create(&tid, NULL, cb, msg))
+	for (int i = 1; i < nr_udp_shards; i++) {
+		if (pthread_create(&tid, NULL, udp_receive_loop, &udp_shards[i]))
 			perror("pthread_create");
 		else
 			pthread_detach(tid);
 	}
-	close(sock);
+	udp_receive_loop(&udp_shards[0]);
 }
@@ -0,0 +1,79 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define SLAB_ALIGN sizeof(long double)
+
+void slab_init(struct slab_cache *c, size_t size)
+{
+	if (size < sizeof(void*))
+		size = sizeof(void*);
+	c->size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	c->free_list = NULL;
+	c->stats = (struct slab_stats) { .object_size = c->size };
+}
+
+/*
+ * Allocates a new slab and puts its objects on the free list.
+ */
+static int slab_grow(struct slab_cache *c)
+{
+	size_t nr = c->size < SLAB_SIZE ? SLAB_SIZE / c->size : 1;
+	char *slab = malloc(nr * c->size);
+
+	if (!slab)
+		return -1;
+
+	for (size_t i = 0; i < nr; i++) {
+		void **obj = (void**) (slab + i * c->size);
+		*obj = c->free_list;
+		c->free_list = obj;
+	}
+	c->stats.slabs++;
+	c->stats.free += nr;
+	return 0;
+}
+
+/*
+ * Returns an uninitialized object, or NULL if memory is exhausted.
+ */
+void *slab_alloc(struct slab_cache *c)
+{
+	void **obj;
+
+	if (!c->free_list && slab_grow(c))
+		return NULL;
+
+	obj = c->free_list;
+	c->free_list = *obj;
+	c->stats.free--;
+	c->stats.in_use++;
+	c->stats.allocs++;
+	return obj;
+}
+
+void slab_free(struct slab_cache *c, void *obj)
+{
+	*(void**) obj = c->free_list;
+	c->free_list = obj;
+	c->stats.in_use--;
+	c->stats.free++;
+}
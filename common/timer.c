@@ -0,0 +1,181 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Timer service: a single thread runs every scheduled callback, sleeping on a
+ * CLOCK_MONOTONIC condition variable until the earliest one is due.  Pending
+ * timers are kept in a binary min-heap ordered by due time.
+ *
+ * Callbacks run one at a time on the timer thread, without the heap lock
+ * held, so they must not block for long.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timer.h"
+
+struct timer {
+	uint64_t due; /* CLOCK_MONOTONIC time in milliseconds */
+	timer_fn fn;
+	void *arg;
+};
+
+static struct {
+	struct timer *heap;
+	size_t nr;
+	size_t max;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} timers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_once_t timers_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void heap_swap(size_t i, size_t j)
+{
+	struct timer tmp = timers.heap[i];
+
+	timers.heap[i] = timers.heap[j];
+	timers.heap[j] = tmp;
+}
+
+static void heap_push(struct timer *t)
+{
+	size_t i, parent;
+
+	if (timers.nr == timers.max) {
+		timers.max = timers.max ? timers.max * 2 : 16;
+		timers.heap = realloc(timers.heap,
+				timers.max * sizeof(struct timer));
+		if (!timers.heap) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	i = timers.nr++;
+	timers.heap[i] = *t;
+	for (; i; i = parent) {
+		parent = (i - 1) / 2;
+		if (timers.heap[parent].due <= timers.heap[i].due)
+			break;
+		heap_swap(i, parent);
+	}
+}
+
+static void heap_pop(struct timer *t)
+{
+	size_t i, child;
+
+	*t = timers.heap[0];
+	timers.heap[0] = timers.heap[--timers.nr];
+	for (i = 0; (child = 2 * i + 1) < timers.nr; i = child) {
+		if (child + 1 < timers.nr &&
+				timers.heap[child + 1].due < timers.heap[child].due)
+			child++;
+		if (timers.heap[i].due <= timers.heap[child].due)
+			break;
+		heap_swap(i, child);
+	}
+}
+
+static _Noreturn void *timer_thread(void *data)
+{
+	struct timespec ts;
+	struct timer t;
+	unsigned int next;
+	uint64_t now;
+
+	pthread_mutex_lock(&timers.lock);
+	for (;;) {
+		if (!timers.nr) {
+			pthread_cond_wait(&timers.cond, &timers.lock);
+			continue;
+		}
+
+		now = now_ms();
+		if (timers.heap[0].due > now) {
+			ts.tv_sec = timers.heap[0].due / 1000;
+			ts.tv_nsec = (timers.heap[0].due % 1000) * 1000000;
+			pthread_cond_timedwait(&timers.cond, &timers.lock, &ts);
+			continue;
+		}
+
+		heap_pop(&t);
+		pthread_mutex_unlock(&timers.lock);
+		next = t.fn(t.arg);
+		pthread_mutex_lock(&timers.lock);
+
+		if (next) {
+			/* keep to the schedule, unless it has fallen behind */
+			t.due += next;
+			if (t.due < (now = now_ms()))
+				t.due = now + next;
+			heap_push(&t);
+		}
+	}
+}
+
+static void timers_init(void)
+{
+	pthread_condattr_t attr;
+	pthread_t tid;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timers.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&tid, NULL, timer_thread, NULL))
+		perror("pthread_create");
+	else
+		pthread_detach(tid);
+}
+
+/*
+ * Arranges for `fn' to be called with `arg' on the timer thread after
+ * `delay_ms' milliseconds.
+ */
+void timer_schedule(unsigned int delay_ms, timer_fn fn, void *arg)
+{
+	struct timer t = {
+		.due = now_ms() + delay_ms,
+		.fn = fn,
+		.arg = arg
+	};
+
+	pthread_once(&timers_once, timers_init);
+
+	pthread_mutex_lock(&timers.lock);
+	heap_push(&t);
+	pthread_cond_signal(&timers.cond); /* it may now be the earliest */
+	pthread_mutex_unlock(&timers.lock);
+}
@@ -0,0 +1,104 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "timerwheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+	w->now = now;
+	for (int i = 0; i < TW_LEVELS; i++)
+		for (int j = 0; j < TW_SLOTS; j++)
+			INIT_LIST_HEAD(&w->slots[i][j]);
+}
+
+/*
+ * Puts a timer in the slot for its expiry, relative to the current tick.
+ */
+static void place(struct timer_wheel *w, struct timer_entry *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	int level;
+
+	/* timers already due fire on the next tick */
+	if (expires < w->now)
+		expires = w->now;
+
+	delta = expires - w->now;
+	if (delta >= TW_RANGE)
+		expires = w->now + TW_RANGE - 1;
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < 1ULL << (TW_BITS * (level + 1)))
+			break;
+	}
+
+	list_add_tail(&t->chain,
+		&w->slots[level][(expires >> (TW_BITS * level)) & TW_MASK]);
+}
+
+void timer_wheel_add(struct timer_wheel *w, struct timer_entry *t,
+		uint64_t expires)
+{
+	t->expires = expires;
+	place(w, t);
+}
+
+void timer_wheel_del(struct timer_entry *t)
+{
+	list_del_init(&t->chain);
+}
+
+/*
+ * Re-places the timers in slot `index' of `level', moving them to lower
+ * levels.  Returns `index'.
+ */
+static int cascade(struct timer_wheel *w, int level, int index)
+{
+	struct timer_entry *t, *next;
+	LIST_HEAD(slot);
+
+	list_splice_init(&w->slots[level][index], &slot);
+	list_for_each_entry_safe(t, next, &slot, chain)
+		place(w, t);
+	return index;
+}
+
+/*
+ * Processes every tick up to and including `now', moving timers which expire
+ * onto `expired' in expiry order.
+ */
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now,
+		struct list_head *expired)
+{
+	int index, level;
+
+	while (w->now <= now) {
+		index = w->now & TW_MASK;
+
+		/* at the start of each lap of a level, refill it from above */
+		for (level = 1; !index && level < TW_LEVELS; level++)
+			index = cascade(w, level,
+				(w->now >> (TW_BITS * level)) & TW_MASK);
+
+		list_splice_tail_init(&w->slots[0][w->now & TW_MASK], expired);
+		w->now++;
+	}
+}
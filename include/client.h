@@ -23,6 +23,14 @@
 
 #include "types.h"
 
+/* milliseconds without a keepalive before a client is dropped */
+#ifndef CLIENT_TIMEOUT
+#define CLIENT_TIMEOUT 10000
+#endif
+
+/* keepalives applied to the client table at once by flush_clients() */
+#define CLIENT_BATCH 64
+
 struct msg_info;
 
 enum client_rc {
@@ -34,13 +42,18 @@ enum client_rc {
 };
 
 struct response_node;
+struct slab_stats;
+struct udp_fanout;
 
-void clients_init(void);
+void clients_init(unsigned int timeout_ms);
 int add_client(struct sockaddr_storage *addr, const char *port);
+int queue_client(struct sockaddr_storage *addr, const char *port);
+void flush_clients(void);
 int remove_client(struct sockaddr_storage *addr, const char *port);
 int clients_to_json(struct list_head *head, struct sockaddr_storage *ign,
 		const char *n);
-int flood_to_clients(struct msg_info *mi);
+int flood_to_clients(struct udp_fanout *fo);
 unsigned int client_list_size(void);
+void client_alloc_stats(struct slab_stats *stats);
 
 #endif
@@ -19,20 +19,110 @@
 #ifndef _PSNET_DELTALIST_H_
 #define _PSNET_DELTALIST_H_
 
-#ifndef HT_SIZE
-#define HT_SIZE 10
+#include <pthread.h>
+#include <stdint.h>
+
+#include "slab.h"
+#include "timerwheel.h"
+
+#ifndef HT_MIN_SIZE
+#define HT_MIN_SIZE 16 // initial (and minimum) number of buckets
+#endif
+
+#ifndef DELTA_EXPIRE_BATCH
+#define DELTA_EXPIRE_BATCH 256 // default expired elements removed per lock
+#endif
+
+#ifndef DELTA_STRIPES
+#define DELTA_STRIPES 16 // default number of independently locked stripes
 #endif
+#define DELTA_MAX_STRIPE_BITS 10
+#define DELTA_MAX_STRIPES (1 << DELTA_MAX_STRIPE_BITS)
+
+#define DELTA_BATCH 64 // elements grouped by stripe in delta_update_many()
 
 typedef void data_t;
 
+struct delta_node {
+	const data_t *data;
+	unsigned long hash;         // mixed hash of `data'
+	struct delta_node *ht_next; // hash table next pointer
+	struct timer_entry timer;   // expiry timer
+	struct list_head chain;     // position in stripe->nodes
+	char key[];                 // the element, if table->key_size is set
+};
+
+/*
+ * A slice of a delta_list: the elements whose hashes select it, with their
+ * own lock, index, expiry timers and allocator.  Operations on elements in
+ * different stripes do not contend.
+ */
+struct delta_stripe {
+	pthread_mutex_t lock;
+
+	unsigned int size;             // number of elements in the stripe
+	struct timer_wheel wheel;      // element expiry timers
+	struct list_head expired;      // fired timers not yet removed
+	struct list_head nodes;        // elements, least recently updated first
+
+	struct slab_cache nodes_slab;  // node allocator, under `lock'
+
+	struct delta_snapshot *snapshot; // current snapshot, or NULL
+	struct list_head snapshots;      // live snapshots, oldest first
+
+	/*
+	 * Hash index: a power-of-two array of buckets which grows and shrinks
+	 * with `size'.  When it is resized, buckets are moved from the old array
+	 * to the new one a few at a time by subsequent operations.
+	 */
+	struct delta_node **table;     // bucket array
+	unsigned long nr_buckets;      // number of buckets in `table'
+	struct delta_node **old_table; // array being rehashed from, or NULL
+	unsigned long old_nr_buckets;  // number of buckets in `old_table'
+	unsigned long rehash_pos;      // next bucket of `old_table' to move
+} __attribute__((aligned(64)));
+
+/*
+ * A hash table whose elements expire a given time after they were last
+ * inserted or updated.  Expiry is driven by a timing wheel, advanced every
+ * `tick_ms' milliseconds by the timer service.
+ *
+ * The table is split into `nr_stripes' stripes by the high bits of each
+ * element's hash, each under its own lock and expiring on its own; only the
+ * element count is shared, and it is maintained atomically.
+ *
+ * If `key_size' is set, elements are fixed-size keys which the table copies
+ * into its own nodes: callers may pass pointers to temporaries, and `free' is
+ * never called.  Otherwise the table stores the callers' pointers, and frees
+ * them with `free' when they are removed.
+ *
+ * If `intrusive' is set, callers embed a struct delta_node in each element,
+ * pointing its `data' at the element, and insert elements with
+ * delta_update_node(): the table allocates nothing, and `free' releases the
+ * whole element, node included.
+ *
+ * Expired elements are removed `expire_batch' at a time, and `act' is called
+ * on them after the lock is released, so a mass expiry does not stall other
+ * users of the table.
+ *
+ * If `lazy' is set, there is no timing wheel and nothing runs in the
+ * background: elements are timestamped from the coarse clock, treated as
+ * absent once expired, and removed when they are next looked up or by later
+ * insertions.  `act' is then called with a lock held, and must not use the
+ * table.  Expired elements count towards `size' until they are removed.
+ */
 struct delta_list {
-	unsigned int resolution;       // seconds per tick
-	unsigned int interval;         // expiration inverval (measured in ticks)
+	unsigned int timeout_ms;       // default expiry timeout
+	unsigned int tick_ms;          // expiry resolution; 0 derives it from
+	                               // timeout_ms
 	unsigned int size;             // number of elements in the list
-	unsigned int delta;            // sum of all individual deltas
-
-	struct delta_node *delta_head; // head of the delta list
-	struct delta_node *delta_tail; // tail of the delta list
+	size_t key_size;               // size of inline keys, or 0
+	int intrusive;                 // nodes are embedded in elements
+	int lazy;                      // expire on access, not by a timer
+	unsigned int expire_batch;     // most elements expired per lock hold;
+	                               // 0 means DELTA_EXPIRE_BATCH
+	unsigned int nr_stripes;       // rounded up to a power of two, at most
+	                               // DELTA_MAX_STRIPES; 0 means DELTA_STRIPES
 
 	/* functions that operate on data_t */
 	unsigned long (* const hash)(const data_t*);
@@ -40,19 +130,180 @@ struct delta_list {
 	void (* const act)(const data_t*);
 	void (* const free)(data_t*);
 
-	pthread_mutex_t lock;
-
-	struct delta_node *table[HT_SIZE]; // memory for the hash table
+	struct delta_stripe *stripes;
 };
 
 void delta_init(struct delta_list *table);
 void delta_insert(struct delta_list *table, const data_t *data);
 int delta_update(struct delta_list *table, const data_t *data);
+int delta_update_timeout(struct delta_list *table, const data_t *data,
+		unsigned int timeout_ms);
+int delta_update_node(struct delta_list *table, struct delta_node *node);
+int delta_update_node_timeout(struct delta_list *table,
+		struct delta_node *node, unsigned int timeout_ms);
 int delta_remove(struct delta_list *table, const data_t *data);
+unsigned int delta_update_many(struct delta_list *table,
+		const data_t *const data[], int rc[], unsigned int n);
+unsigned int delta_remove_many(struct delta_list *table,
+		const data_t *const data[], int rc[], unsigned int n);
 int delta_contains(struct delta_list *table, const data_t *data);
 const data_t *delta_get(struct delta_list *table, const data_t *data);
 void delta_clear(struct delta_list *table);
 void delta_foreach(struct delta_list *table,
 		int (*fun)(const data_t *it, void *arg), void *arg);
+void delta_foreach_ttl(struct delta_list *table,
+		int (*fun)(const data_t *it, unsigned int ttl_ms, void *arg),
+		void *arg);
 unsigned int delta_size(struct delta_list *table);
+void delta_alloc_stats(struct delta_list *table, struct slab_stats *stats);
+
+struct delta_node **__delta_expire_link(struct delta_list *table,
+		struct delta_stripe *s, struct delta_node **link);
+int __delta_update_locked(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node **link, const data_t *data, unsigned long hash,
+		unsigned int timeout_ms);
+void __delta_remove_locked(struct delta_list *table, struct delta_stripe *s,
+		struct delta_node **link);
+
+/*
+ * Mixes the result of a table's hash function so that the low bits, which
+ * select the bucket, depend on all of its bits.
+ */
+static inline unsigned long delta_mix_hash(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Returns the stripe holding elements with the (mixed) hash `hash'.  Buckets
+ * are selected by the low bits, so stripes use the high ones.
+ */
+static inline struct delta_stripe *delta_stripe(struct delta_list *table,
+		unsigned long hash)
+{
+	return &table->stripes[(hash >> (sizeof(unsigned long) * 8 -
+				DELTA_MAX_STRIPE_BITS)) & (table->nr_stripes - 1)];
+}
+
+/*
+ * Returns the link pointing to the node for `data' in a bucket, or to the
+ * NULL terminating the bucket if there is no such node.
+ */
+static inline __attribute__((always_inline)) struct delta_node **
+__delta_bucket_find(struct delta_node **link, const data_t *data,
+		unsigned long hash, int (*equals)(const data_t*, const data_t*))
+{
+	for (; *link; link = &(*link)->ht_next) {
+		if ((*link)->hash == hash && equals((*link)->data, data))
+			break;
+	}
+	return link;
+}
+
+/*
+ * Finds the link (a bucket head or the previous node's ht_next) pointing to
+ * the node for `data' in stripe `s', or returns NULL if it is not there.  The
+ * stripe lock must be held.
+ *
+ * This is always inlined: when `equals' is a constant, as in the functions
+ * generated by DEFINE_DELTA_LIST(), the comparison is inlined too.
+ */
+static inline __attribute__((always_inline)) struct delta_node **
+__delta_get_link(struct delta_stripe *s, const data_t *data,
+		unsigned long hash, int (*equals)(const data_t*, const data_t*))
+{
+	struct delta_node **link;
+
+	if (s->old_table) {
+		link = __delta_bucket_find(&s->old_table[hash &
+				(s->old_nr_buckets - 1)], data, hash, equals);
+		if (*link)
+			return link;
+	}
+
+	link = __delta_bucket_find(&s->table[hash & (s->nr_buckets - 1)],
+			data, hash, equals);
+	return *link ? link : NULL;
+}
+
+/*
+ * As __delta_get_link(), but an expired element of a lazy table is removed,
+ * and reported as absent.
+ */
+static inline __attribute__((always_inline)) struct delta_node **
+__delta_find(struct delta_list *table, struct delta_stripe *s,
+		const data_t *data, unsigned long hash,
+		int (*equals)(const data_t*, const data_t*))
+{
+	struct delta_node **link = __delta_get_link(s, data, hash, equals);
+
+	if (link && table->lazy)
+		link = __delta_expire_link(table, s, link);
+	return link;
+}
+
+/*
+ * Defines functions name##_update(), name##_update_timeout(), name##_remove()
+ * and name##_contains(), which behave as their delta_*() counterparts on a
+ * table of `type' keys, but call `hashfn' and `equalsfn' directly rather than
+ * through the table's function pointers, so that both can be inlined into the
+ * probe.  The table must still set `hash' and `equals' (to the same functions)
+ * for the generic operations, such as expiry.
+ */
+#define DEFINE_DELTA_LIST(name, type, hashfn, equalsfn)			\
+static inline int name##_equals(const data_t *a, const data_t *b)	\
+{									\
+	return equalsfn(a, b);						\
+}									\
+									\
+static inline int name##_update_timeout(struct delta_list *table,	\
+		const type *key, unsigned int timeout_ms)		\
+{									\
+	unsigned long hash = delta_mix_hash(hashfn(key));		\
+	struct delta_stripe *s = delta_stripe(table, hash);		\
+	int rc;								\
+									\
+	pthread_mutex_lock(&s->lock);					\
+	rc = __delta_update_locked(table, s, __delta_find(table, s, key,	\
+				hash, name##_equals), key, hash,	\
+			timeout_ms);					\
+	pthread_mutex_unlock(&s->lock);					\
+	return rc;							\
+}									\
+									\
+static inline int name##_update(struct delta_list *table,		\
+		const type *key)					\
+{									\
+	return name##_update_timeout(table, key, table->timeout_ms);	\
+}									\
+									\
+static inline int name##_remove(struct delta_list *table,		\
+		const type *key)					\
+{									\
+	unsigned long hash = delta_mix_hash(hashfn(key));		\
+	struct delta_stripe *s = delta_stripe(table, hash);		\
+	struct delta_node **link;					\
+									\
+	pthread_mutex_lock(&s->lock);					\
+	if ((link = __delta_find(table, s, key, hash, name##_equals)))	\
+		__delta_remove_locked(table, s, link);			\
+	pthread_mutex_unlock(&s->lock);					\
+	return link ? 0 : -1;						\
+}									\
+									\
+static inline int name##_contains(struct delta_list *table,		\
+		const type *key)					\
+{									\
+	unsigned long hash = delta_mix_hash(hashfn(key));		\
+	struct delta_stripe *s = delta_stripe(table, hash);		\
+	int rc;								\
+									\
+	pthread_mutex_lock(&s->lock);					\
+	rc = !!__delta_find(table, s, key, hash, name##_equals);	\
+	pthread_mutex_unlock(&s->lock);					\
+	return rc;							\
+}
 #endif
@@ -89,7 +89,7 @@ static inline int ip_addr_equals (const struct sockaddr *a,
         return 0;
     if (a->sa_family == AF_INET) {
         return ((struct sockaddr_in*)a)->sin_addr.s_addr
-            != ((struct sockaddr_in*)b)->sin_addr.s_addr;
+            == ((struct sockaddr_in*)b)->sin_addr.s_addr;
     } else {
         return !memcmp (((struct sockaddr_in6*)a)->sin6_addr.s6_addr,
                 ((struct sockaddr_in6*)b)->sin6_addr.s6_addr, 16);
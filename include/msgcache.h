@@ -19,8 +19,60 @@
 #ifndef _PSNET_MSGCACHE_H_
 #define _PSNET_MSGCACHE_H_
 
-void msg_cache_init(void);
-int cache_msg(char *id);
+#include <stddef.h>
+
+/* milliseconds for which a message ID is remembered */
+#ifndef MSG_CACHE_TIMEOUT
+#define MSG_CACHE_TIMEOUT 10000
+#endif
+
+/* space for a message ID in the cache, including the terminating NUL */
+#ifndef MSG_ID_MAX
+#define MSG_ID_MAX 64
+#endif
+
+/* most sequence numbers remembered per origin */
+#define MSG_SEQ_WINDOW_MAX 65536
+
+/* how duplicate message IDs are detected */
+enum msg_cache_mode {
+	MSG_CACHE_EXACT, /* remember every ID until it expires */
+	MSG_CACHE_BLOOM  /* rotating Bloom filters: fixed memory, but a
+	                    fraction of new IDs are taken for duplicates */
+};
+
+struct msg_cache_opts {
+	unsigned int timeout_ms;
+	enum msg_cache_mode mode;
+	int lazy;               /* exact: expire on lookup, not by a timer */
+	unsigned int shards;    /* exact: locked stripes, 0 for the default */
+	int string_keys;        /* exact: compare whole IDs, not digests */
+	unsigned int seq_window; /* sequence numbers remembered per origin for
+	                            `origin:sequence' IDs, or 0 */
+	unsigned long capacity; /* bloom: IDs expected per timeout period */
+	double fp_rate;         /* bloom: target false positive rate */
+};
+
+#define MSG_CACHE_OPTS_INIT {			\
+	.timeout_ms = MSG_CACHE_TIMEOUT,	\
+	.mode       = MSG_CACHE_EXACT,		\
+	.lazy       = 0,			\
+	.shards     = 0,			\
+	.string_keys = 0,			\
+	.seq_window = 0,			\
+	.capacity   = 1000000,			\
+	.fp_rate    = 0.001,			\
+}
+
+struct slab_stats;
+
+void msg_cache_init(const struct msg_cache_opts *opts);
+int cache_msg(const char *id, size_t len);
 unsigned int msg_cache_size(void);
+unsigned int msg_cache_origins(void);
+int msg_cache_save(const char *path);
+int msg_cache_load(const char *path);
+void msg_cache_alloc_stats(struct slab_stats *keys, struct slab_stats *origins,
+		struct slab_stats *long_ids);
 
 #endif
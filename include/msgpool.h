@@ -0,0 +1,38 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _MSGPOOL_H
+#define _MSGPOOL_H
+
+#include <stddef.h>
+
+struct msg_info;
+
+struct msgpool_stats {
+	size_t capacity;
+	unsigned long hits;      /* served from the calling thread's cache */
+	unsigned long misses;    /* served from the shared depot */
+	unsigned long exhausted; /* refused because the pool was empty */
+};
+
+void msgpool_init(size_t capacity);
+struct msg_info *msgpool_get(void);
+void msgpool_put(struct msg_info *mi);
+void msgpool_stats(struct msgpool_stats *stats);
+
+#endif
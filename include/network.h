@@ -21,15 +21,78 @@
 
 #include <unistd.h> /* ssize_t */
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include "types.h"
 
 ssize_t tcp_send_bytes(int sock, const char *buf, size_t len);
+ssize_t tcp_send_iov(int sock, struct iovec *iov, int iovcnt);
 ssize_t tcp_sendf(int sock, size_t size, const char *fmt, ...);
 ssize_t tcp_read_bytes(int sock, char *msg_buf, size_t bytes);
-ssize_t tcp_read_msg(int sock, char *buf, size_t len);
+
+#define TCP_READER_BUFSIZ 4096
+
+/*
+ * Buffered reader for a TCP connection.  Each recv() takes as much as is
+ * available, and bytes read past the end of one message are kept for the
+ * next, so pipelined requests cost no extra system calls.
+ */
+struct tcp_reader {
+	int sock;
+	size_t start; /* offset of the first unconsumed byte */
+	size_t end;   /* offset one past the last buffered byte */
+	size_t scan;  /* offset at which to resume the delimiter search */
+	char buf[TCP_READER_BUFSIZ];
+};
+
+void tcp_reader_init(struct tcp_reader *r, int sock);
+ssize_t tcp_reader_fill(struct tcp_reader *r, int flags);
+ssize_t tcp_reader_next(struct tcp_reader *r, char *buf, size_t len);
+ssize_t tcp_reader_msg(struct tcp_reader *r, char *buf, size_t len);
+ssize_t tcp_reader_bytes(struct tcp_reader *r, char *buf, size_t bytes);
+
+/*
+ * Enables TCP_CORK around multi-part responses, so that they are sent in as
+ * few segments as possible.  Off by default.
+ */
+void tcp_send_set_cork(int on);
+void tcp_cork(int sock, int on);
+
+/*
+ * Sets the send buffer size of the sockets used by udp_send() and
+ * udp_fanout_send().  Must be called before anything is sent.
+ */
+void udp_send_set_buffer(int size);
+
+/*
+ * Makes udp_send() and udp_fanout_send() send datagrams for the address family
+ * of `sock' from `sock', typically a bound listening socket, so that replies
+ * come from the advertised port.
+ */
+void udp_send_set_source(int sock);
+
 int udp_send(const struct sockaddr *addr, size_t len, const char *msg);
 int udp_sendf(const struct sockaddr *addr, size_t size, const char *fmt, ...);
 
+/*
+ * A datagram to be sent to many destinations.  Destinations are collected with
+ * udp_fanout_add() and sent with as few sendmmsg() calls as possible by
+ * udp_fanout_send().
+ */
+struct udp_fanout {
+	const char *msg;
+	size_t len;
+	unsigned int nr_dests;
+	unsigned int max_dests;
+	struct sockaddr_storage *dests;
+	unsigned long sent;   /* datagrams sent */
+	unsigned long failed; /* destinations that could not be sent to */
+};
+
+void udp_fanout_init(struct udp_fanout *fo, const char *msg, size_t len);
+void udp_fanout_free(struct udp_fanout *fo);
+void udp_fanout_add(struct udp_fanout *fo, const struct sockaddr *addr);
+int udp_fanout_send(struct udp_fanout *fo);
+
 #endif
@@ -27,6 +27,11 @@
 
 #define PSNET_ERRSTRLEN 100
 
+/* seconds to wait on a tracker or router before giving up on a request */
+#ifndef PSNET_REQUEST_TIMEOUT
+#define PSNET_REQUEST_TIMEOUT 5
+#endif
+
 int psnet_raw_request_discover(PSNET *ent, char **dst, int num, int port);
 
 int psnet_raw_request_list(PSNET *ent, char **dst, int num);
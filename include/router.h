@@ -36,6 +36,7 @@ struct response_node;
 
 int router_init(char *dir_addr, char *dir_port, char *listen_port);
 void flood_message(struct msg_info *mi);
+void flood_stats(unsigned long *sent, unsigned long *failed);
 void routers_to_json(struct list_head *head, int n);
 
 #endif
@@ -21,15 +21,126 @@
 
 #include "types.h"
 
+#define SERVER_MAX_SHARDS 64
+
+/* space needed for the output of server_stats_json() */
+#define SERVER_STATS_STRLEN (128 + 6 * 21 + 2 * 21 * (SERVER_MAX_SHARDS + 1))
+
 extern int num_threads;
 extern pthread_mutex_t num_threads_lock;
 
-int tcp_server_init(char *port);
+/* models for servicing TCP connections */
+enum tcp_model {
+	TCP_THREADS, /* one thread per connection */
+	TCP_EPOLL    /* connections multiplexed over a few event loops */
+};
+
+/* what to do with a datagram when the UDP work queue is full */
+enum udp_overflow {
+	UDP_DROP_NEWEST, /* discard the incoming datagram */
+	UDP_DROP_OLDEST, /* discard the oldest queued datagram */
+	UDP_BLOCK        /* stop receiving until a worker catches up */
+};
 
-_Noreturn void tcp_server_main(int sock, int max_threads, void*(*cb)(void*));
+/*
+ * Server tuning options, settable from psnetrc via server_ini_handler().
+ */
+struct server_opts {
+	enum tcp_model tcp_model;
+	int event_loops;
+	int listen_shards;   /* SO_REUSEPORT sockets per protocol */
+	int pin_shards;      /* pin each shard's thread to a CPU */
+	int udp_workers;
+	int udp_queue_depth;
+	enum udp_overflow udp_overflow;
+	int udp_batch;       /* max datagrams per receive call */
+	long udp_batch_wait; /* microseconds to wait for a batch to fill */
+	int send_buffer;     /* SO_SNDBUF for UDP senders, 0 for default */
+	int send_from_listen; /* send datagrams from the listening socket */
+	int tcp_cork;        /* cork TCP responses while they are written */
+	int msg_pool_size;   /* messages and connections in flight */
+};
+
+#define SERVER_OPTS_INIT {			\
+	.tcp_model       = TCP_THREADS,		\
+	.event_loops     = 4,			\
+	.listen_shards   = 1,			\
+	.pin_shards      = 1,			\
+	.udp_workers     = 4,			\
+	.udp_queue_depth = 1024,		\
+	.udp_overflow    = UDP_DROP_NEWEST,	\
+	.udp_batch       = 32,			\
+	.udp_batch_wait  = 0,			\
+	.send_buffer     = 0,			\
+	.send_from_listen = 1,			\
+	.tcp_cork        = 0,			\
+	.msg_pool_size   = 4096,		\
+}
 
-int udp_server_init(char *port);
+/*
+ * A listening socket.  With listen-shards > 1, several sockets share a port
+ * via SO_REUSEPORT and the kernel spreads traffic across them.
+ */
+struct server_shard {
+	int sock;
+	unsigned long count; /* datagrams received or connections accepted */
+};
+
+/* counters for the UDP server, reported by the info method */
+struct udp_stats {
+	unsigned long received;
+	unsigned long dropped;
+};
+
+/*
+ * Handles a psnetrc option understood by the common server code.  Returns 1 if
+ * the option was recognized (even if its value was rejected), or 0 otherwise.
+ */
+int server_ini_handler(struct server_opts *opts, const char *file,
+		const char *name, const char *value);
+
+/*
+ * Writes the server counters into `buf' as a comma-separated list of JSON
+ * members, for inclusion in the response to an info request.
+ */
+int server_stats_json(char *buf, size_t len);
+
+/*
+ * Pins the calling thread to CPU number `n' (modulo the number of CPUs).
+ */
+void server_pin_thread(int n);
+
+int tcp_server_init(char *port, int reuseport);
+
+/*
+ * Listens on `port' and services TCP connections according to `opts'.
+ * `dispatch' is called for each request read from a connection; a non-zero
+ * return value closes the connection.  At most `max_conns' connections are
+ * serviced concurrently.
+ */
+_Noreturn void tcp_server_main(char *port, const struct server_opts *opts,
+		int max_conns, int (*dispatch)(struct msg_info*));
+
+/*
+ * Services connections on the given listening sockets with opts->event_loops
+ * epoll event loops (see tcp_server_main()).
+ */
+_Noreturn void tcp_reactor_main(struct server_shard *shards, int nr_shards,
+		const struct server_opts *opts, int max_conns,
+		int (*dispatch)(struct msg_info*));
+
+int udp_server_init(char *port, int reuseport);
+
+/*
+ * Receives datagrams on `port' and queues them for a pool of worker threads,
+ * which call `cb' on each one.  The struct msg_info is freed when `cb'
+ * returns.  Workers take datagrams from the queue in batches, and call
+ * `flush' (if not NULL) after each batch, so that `cb' can defer work and
+ * apply it in bulk.
+ */
+_Noreturn void udp_server_main(char *port, const struct server_opts *opts,
+		void (*cb)(struct msg_info*), void (*flush)(void));
 
-_Noreturn void udp_server_main(int sock, int max_threads, void *(*cb)(void*));
+void udp_server_stats(struct udp_stats *stats);
 
 #endif
@@ -0,0 +1,56 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_SIZE (64 * 1024)
+
+struct slab_stats {
+	size_t object_size;
+	unsigned long in_use; /* objects allocated */
+	unsigned long free;   /* objects available without a new slab */
+	unsigned long slabs;  /* slabs obtained from malloc() */
+	unsigned long allocs; /* total calls to slab_alloc() */
+};
+
+#define SLAB_STATS_FMT "{\"object-size\":%zu,\"in-use\":%lu,\"free\":%lu," \
+	"\"slabs\":%lu,\"allocs\":%lu}"
+#define SLAB_STATS_STRLEN (64 + 5 * 20)
+#define SLAB_STATS_ARGS(st) (st).object_size, (st).in_use, (st).free, \
+	(st).slabs, (st).allocs
+
+/*
+ * A cache of fixed-size objects carved out of SLAB_SIZE slabs.  Freed objects
+ * go on a free list for reuse; slabs are never returned to the system, so a
+ * cache's footprint is its high-water mark.  Caches do no locking of their
+ * own: callers serialize access, typically under a lock they already hold.
+ */
+struct slab_cache {
+	size_t size;     /* object size, rounded up for alignment */
+	void *free_list; /* free objects, linked through their first word */
+	struct slab_stats stats;
+};
+
+void slab_init(struct slab_cache *c, size_t size);
+void *slab_alloc(struct slab_cache *c);
+void slab_free(struct slab_cache *c, void *obj);
+
+#endif
@@ -0,0 +1,30 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _TIMER_H
+#define _TIMER_H
+
+/*
+ * A timer callback.  Returns the number of milliseconds until it should run
+ * again, or 0 if it should not.
+ */
+typedef unsigned int (*timer_fn)(void *arg);
+
+void timer_schedule(unsigned int delay_ms, timer_fn fn, void *arg);
+
+#endif
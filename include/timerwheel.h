@@ -0,0 +1,60 @@
+/* Copyright 2013 Drew Thoreson */
+
+/* This file is part of libpsnet
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * libpsnet is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * libpsnet.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+#define TW_BITS   6
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_LEVELS 4
+
+/* the furthest ahead, in ticks, that a timer can be placed precisely */
+#define TW_RANGE  (1ULL << (TW_BITS * TW_LEVELS))
+
+/*
+ * A timer, embedded in whatever it times out.
+ */
+struct timer_entry {
+	struct list_head chain; /* position in a wheel slot */
+	uint64_t expires;       /* tick at which the timer fires */
+};
+
+/*
+ * Hierarchical timing wheel: level 0 has a slot per tick, and each level
+ * above it has slots TW_SLOTS times as coarse.  Timers are moved down a level
+ * ("cascaded") as their expiry approaches, so adding, removing and expiring a
+ * timer are all O(1).  Timers further than TW_RANGE ticks ahead wait in the
+ * top level until they come within range.
+ */
+struct timer_wheel {
+	uint64_t now; /* the next tick to be processed */
+	struct list_head slots[TW_LEVELS][TW_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+void timer_wheel_add(struct timer_wheel *w, struct timer_entry *t,
+		uint64_t expires);
+void timer_wheel_del(struct timer_entry *t);
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now,
+		struct list_head *expired);
+
+#endif
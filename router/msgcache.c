@@ -16,31 +16,107 @@
  * psnet.  If not, see <http://www.gnu.org/licenses/>
  */
 
-#include <stdlib.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "deltalist.h"
 #include "misc.h"
+#include "msgcache.h"
+#include "slab.h"
+#include "timer.h"
+
+/*
+ * Message IDs are reduced to a 128-bit digest, keyed with a seed chosen at
+ * startup so that colliding IDs cannot be computed in advance.  Any ID then
+ * costs the same to store and compare.
+ */
+struct msg_digest {
+	uint64_t lo;
+	uint64_t hi;
+};
+
+#define DIGEST_STRLEN 32
+
+/*
+ * With string keys, IDs are compared in full instead.  Those short enough are
+ * stored in fixed-size keys; longer ones are kept in a table of their own, each
+ * in a single allocation with its node embedded (an intrusive delta_list).
+ */
+struct msg_key {
+	char id[MSG_ID_MAX];
+};
 
-#define ID_STRLEN 5
+struct long_id {
+	struct delta_node node;
+	size_t len;
+	char id[];
+};
 
+static unsigned long digest_hash(const void *msg);
+static int digest_equals(const void *a, const void *b);
 static unsigned long delta_hash(const void *msg);
 static int delta_equals(const void *a, const void *b);
 static void delta_act(const void *msg);
+static unsigned long long_hash(const void *msg);
+static int long_equals(const void *a, const void *b);
+static void long_act(const void *msg);
 
 static struct delta_list msg_cache = {
-	.resolution = 1,
-	.interval = 10,
+	.timeout_ms = MSG_CACHE_TIMEOUT,
+	.size = 0,
+	.key_size = sizeof(struct msg_digest),
+	.hash = digest_hash,
+	.equals = digest_equals,
+	.act = delta_act
+};
+
+static struct delta_list string_cache = {
+	.timeout_ms = MSG_CACHE_TIMEOUT,
 	.size = 0,
-	.delta = 0,
-	.delta_head = NULL,
-	.delta_tail = NULL,
+	.key_size = sizeof(struct msg_key),
 	.hash = delta_hash,
 	.equals = delta_equals,
-	.act = delta_act,
+	.act = delta_act
+};
+
+static struct delta_list long_cache = {
+	.timeout_ms = MSG_CACHE_TIMEOUT,
+	.size = 0,
+	.intrusive = 1,
+	.hash = long_hash,
+	.equals = long_equals,
+	.act = long_act,
 	.free = free
 };
+static unsigned long long_allocs; /* long IDs allocated since startup */
+
+static struct delta_list *cache = &msg_cache;
+static int string_keys;
+static uint64_t digest_seed[2];
+
+static unsigned long digest_hash(const void *msg)
+{
+	const struct msg_digest *d = msg;
+
+	return d->lo;
+}
+
+static int digest_equals(const void *a, const void *b)
+{
+	const struct msg_digest *d0 = a;
+	const struct msg_digest *d1 = b;
+
+	return d0->lo == d1->lo && d0->hi == d1->hi;
+}
 
 static unsigned long delta_hash(const void *msg)
 {
@@ -62,30 +138,920 @@ static int delta_equals(const void *a, const void *b)
 	return !strcmp(s0, s1);
 }
 
+DEFINE_DELTA_LIST(msg_digest, struct msg_digest, digest_hash, digest_equals)
+DEFINE_DELTA_LIST(msg_delta, struct msg_key, delta_hash, delta_equals)
+
+static inline const char *digest_str(const struct msg_digest *d, char *buf)
+{
+	sprintf(buf, "%016llx%016llx", (unsigned long long) d->hi,
+			(unsigned long long) d->lo);
+	return buf;
+}
+
+/*
+ * Returns a printable form of a cached key, using `buf' for digests.
+ */
+static inline const char *key_str(const void *msg, char *buf)
+{
+	return string_keys ? msg : digest_str(msg, buf);
+}
+
 static void delta_act(const void *msg)
 {
 #ifdef PSNETLOG
-	const char *id = msg;
-	printf(ANSI_RED "X %s\n" ANSI_RESET, id);
+	char buf[DIGEST_STRLEN + 1];
+	printf(ANSI_RED "X %s\n" ANSI_RESET, key_str(msg, buf));
+#endif
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * Computes the keyed 128-bit digest of an ID, eight bytes at a time in two
+ * independently seeded lanes.  This is not a cryptographic hash.
+ */
+static void make_digest(struct msg_digest *d, const char *id, size_t len)
+{
+	uint64_t a = digest_seed[0] ^ len;
+	uint64_t b = digest_seed[1] ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t w;
+
+	for (; len >= 8; id += 8, len -= 8) {
+		memcpy(&w, id, 8);
+		a = rotl64(a ^ w, 29) * 0x9e3779b97f4a7c15ULL;
+		b = rotl64(b ^ w, 31) * 0xc2b2ae3d27d4eb4fULL;
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, id, len);
+		a = rotl64(a ^ w, 29) * 0x9e3779b97f4a7c15ULL;
+		b = rotl64(b ^ w, 31) * 0xc2b2ae3d27d4eb4fULL;
+	}
+
+	d->lo = delta_mix_hash(a ^ rotl64(b, 32));
+	d->hi = delta_mix_hash(b + a);
+}
+
+/*
+ * Seeds the digest from /dev/urandom, or failing that from the clock.
+ */
+static void seed_digest(void)
+{
+	struct timespec ts;
+	FILE *f;
+
+	if ((f = fopen("/dev/urandom", "r"))) {
+		size_t n = fread(digest_seed, sizeof(digest_seed), 1, f);
+		fclose(f);
+		if (n == 1)
+			return;
+	}
+
+	perror("/dev/urandom");
+	clock_gettime(CLOCK_REALTIME, &ts);
+	digest_seed[0] = delta_mix_hash(ts.tv_sec ^ ((uint64_t) getpid() << 32));
+	digest_seed[1] = delta_mix_hash(ts.tv_nsec ^ digest_seed[0]);
+}
+
+static unsigned long long_hash(const void *msg)
+{
+	const struct long_id *l = msg;
+
+	return delta_hash(l->id);
+}
+
+static int long_equals(const void *a, const void *b)
+{
+	const struct long_id *l0 = a;
+	const struct long_id *l1 = b;
+
+	return l0->len == l1->len && !memcmp(l0->id, l1->id, l0->len);
+}
+
+static void long_act(const void *msg)
+{
+#ifdef PSNETLOG
+	const struct long_id *l = msg;
+	printf(ANSI_RED "X %s\n" ANSI_RESET, l->id);
 #endif
 }
 
-int cache_msg(char *id)
+/*
+ * Inserts a long ID with the given timeout, as msg_delta_update().
+ */
+static int cache_long_id(const char *id, size_t len, unsigned int timeout_ms)
+{
+	struct long_id *l;
+	int rc;
+
+	if (!(l = malloc(sizeof(*l) + len + 1))) {
+		perror("malloc");
+		return -1;
+	}
+	__atomic_add_fetch(&long_allocs, 1, __ATOMIC_RELAXED);
+	l->node.data = l;
+	l->len = len;
+	memcpy(l->id, id, len);
+	l->id[len] = '\0';
+
+	if ((rc = delta_update_node_timeout(&long_cache, &l->node,
+					timeout_ms)))
+		free(l);
+	return rc;
+}
+
+/*
+ * Records an ID too long for a struct msg_key, as cache_msg().
+ */
+static int cache_long_msg(const char *id, size_t len)
 {
-	int rc = delta_update(&msg_cache, id);
+	int rc = cache_long_id(id, len, long_cache.timeout_ms);
+
 #ifdef PSNETLOG
 	if (!rc)
-		printf(ANSI_GREEN "C %s\n" ANSI_RESET, id);
+		printf(ANSI_GREEN "C %.*s\n" ANSI_RESET, (int) len, id);
 #endif
 	return rc;
 }
 
-void msg_cache_init(void)
+/*
+ * Approximate mode: IDs are recorded in BLOOM_GENERATIONS blocked Bloom
+ * filters, one of which receives new IDs.  Every timeout / (generations - 1)
+ * the oldest filter is cleared and becomes the one receiving IDs, so an ID is
+ * remembered for between one and generations / (generations - 1) timeouts.
+ *
+ * Each ID sets `k' bits within a single 512-bit block (one cache line) of a
+ * filter.  Bits are set with atomic ORs, without locking; two threads adding
+ * the same new ID at the same time may both see it as new.
+ */
+#define BLOOM_GENERATIONS 3
+#define BLOOM_BLOCK_BITS  512
+#define BLOOM_MAX_K       16
+
+struct bloom_block {
+	uint64_t words[BLOOM_BLOCK_BITS / 64];
+} __attribute__((aligned(64)));
+
+static struct {
+	int enabled;
+	unsigned int k;                 /* bits set per ID */
+	unsigned long nr_blocks;        /* blocks per filter */
+	unsigned int interval;          /* milliseconds between rotations */
+	struct bloom_block *filters[BLOOM_GENERATIONS];
+	unsigned long count[BLOOM_GENERATIONS]; /* IDs added to each filter */
+	unsigned int active;            /* filter receiving new IDs */
+} bloom;
+
+/*
+ * Computes the block and bit positions of an ID.
+ */
+static struct bloom_block *bloom_locate(struct bloom_block *filter,
+		uint64_t h1, uint64_t h2, unsigned int *pos)
+{
+	uint32_t a = h2, b = (h2 >> 32) | 1;
+
+	for (unsigned int i = 0; i < bloom.k; i++)
+		pos[i] = (uint32_t) (a + i * b) >> 23; /* top 9 bits */
+	return &filter[((h1 & 0xffffffff) * bloom.nr_blocks) >> 32];
+}
+
+static int bloom_test(struct bloom_block *block, const unsigned int *pos)
+{
+	for (unsigned int i = 0; i < bloom.k; i++) {
+		uint64_t word = __atomic_load_n(&block->words[pos[i] / 64],
+				__ATOMIC_RELAXED);
+		if (!(word & (1ULL << (pos[i] % 64))))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sets an ID's bits, returning non-zero if they were all set already.
+ */
+static int bloom_test_and_set(struct bloom_block *block,
+		const unsigned int *pos)
+{
+	int present = 1;
+
+	for (unsigned int i = 0; i < bloom.k; i++) {
+		uint64_t bit = 1ULL << (pos[i] % 64);
+		if (!(__atomic_fetch_or(&block->words[pos[i] / 64], bit,
+						__ATOMIC_RELAXED) & bit))
+			present = 0;
+	}
+	return present;
+}
+
+static int bloom_cache_msg(const struct msg_digest *d)
+{
+	uint64_t h1 = d->lo, h2 = d->hi;
+	unsigned int active = __atomic_load_n(&bloom.active, __ATOMIC_ACQUIRE);
+	unsigned int pos[BLOOM_MAX_K];
+	struct bloom_block *block;
+
+	for (unsigned int g = 0; g < BLOOM_GENERATIONS; g++) {
+		if (g == active)
+			continue;
+		block = bloom_locate(bloom.filters[g], h1, h2, pos);
+		if (bloom_test(block, pos))
+			return 1;
+	}
+
+	block = bloom_locate(bloom.filters[active], h1, h2, pos);
+	if (bloom_test_and_set(block, pos))
+		return 1;
+	__atomic_add_fetch(&bloom.count[active], 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Timer callback: clears the oldest filter and makes it the active one.
+ */
+static unsigned int bloom_rotate(void *data)
+{
+	unsigned int next = (bloom.active + 1) % BLOOM_GENERATIONS;
+
+	memset(bloom.filters[next], 0,
+			bloom.nr_blocks * sizeof(struct bloom_block));
+	__atomic_store_n(&bloom.count[next], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bloom.active, next, __ATOMIC_RELEASE);
+	return bloom.interval;
+}
+
+/*
+ * Sizes the filters for `capacity' IDs per timeout at a false positive rate
+ * of `fp_rate'.  A lookup checks every filter, so each is given an equal share
+ * of the rate; each filter holds the IDs of one rotation interval.
+ */
+static void bloom_init(const struct msg_cache_opts *opts)
+{
+	unsigned long per_filter = opts->capacity / (BLOOM_GENERATIONS - 1);
+	double p = opts->fp_rate / BLOOM_GENERATIONS;
+	double bits_per_id = -log(p) / (M_LN2 * M_LN2);
+
+	if (!per_filter)
+		per_filter = 1;
+	bloom.k = bits_per_id * M_LN2 + 0.5;
+	if (bloom.k < 1)
+		bloom.k = 1;
+	if (bloom.k > BLOOM_MAX_K)
+		bloom.k = BLOOM_MAX_K;
+	bloom.nr_blocks = (per_filter * bits_per_id + BLOOM_BLOCK_BITS - 1) /
+		BLOOM_BLOCK_BITS;
+	if (!bloom.nr_blocks)
+		bloom.nr_blocks = 1;
+
+	for (int g = 0; g < BLOOM_GENERATIONS; g++) {
+		if (posix_memalign((void**) &bloom.filters[g],
+					sizeof(struct bloom_block),
+					bloom.nr_blocks *
+					sizeof(struct bloom_block))) {
+			perror("posix_memalign");
+			exit(EXIT_FAILURE);
+		}
+		memset(bloom.filters[g], 0,
+				bloom.nr_blocks * sizeof(struct bloom_block));
+	}
+
+	bloom.interval = opts->timeout_ms / (BLOOM_GENERATIONS - 1);
+	if (!bloom.interval)
+		bloom.interval = 1;
+	bloom.enabled = 1;
+	timer_schedule(bloom.interval, bloom_rotate, NULL);
+}
+
+/*
+ * Sequence windows: IDs of the form `origin:sequence', with a decimal
+ * sequence number, are checked against a sliding window over the origin's
+ * most recent sequence numbers, as anti-replay windows are.  The window covers
+ * the `window_words' * 64 sequence numbers up to and including `top', and bit
+ * (seq % width) records whether `seq' has been seen.  An origin is forgotten
+ * after a timeout without messages.  Sequence numbers which have fallen out of
+ * the window, and IDs of other forms, are left to the cache proper.
+ */
+struct origin_window {
+	struct msg_digest origin; /* digest of the origin; the table's key */
+	uint64_t top;             /* highest sequence number seen */
+	uint64_t bits[];          /* window_words words of bitmap */
+};
+
+#define SEQ_MAX_DIGITS 19 /* fits in a uint64_t */
+
+static void origin_act(const void *msg);
+
+static struct delta_list origin_cache = {
+	.timeout_ms = MSG_CACHE_TIMEOUT,
+	.size = 0,
+	.hash = digest_hash,
+	.equals = digest_equals,
+	.act = origin_act
+};
+
+static unsigned int window_words; /* 0 if windows are disabled */
+
+static void origin_act(const void *msg)
+{
+#ifdef PSNETLOG
+	char buf[DIGEST_STRLEN + 1];
+	printf(ANSI_RED "X origin %s\n" ANSI_RESET, digest_str(msg, buf));
+#endif
+}
+
+/*
+ * Splits an ID of the form `origin:sequence'.  Returns -1 if it is not one.
+ */
+static int parse_seq_id(const char *id, size_t len, size_t *origin_len,
+		uint64_t *seq)
+{
+	const char *p = id + len;
+	size_t digits;
+
+	while (p > id && p[-1] >= '0' && p[-1] <= '9')
+		p--;
+	digits = id + len - p;
+	if (!digits || digits > SEQ_MAX_DIGITS || p - id < 2 || p[-1] != ':')
+		return -1;
+
+	*origin_len = p - 1 - id;
+	for (*seq = 0; p < id + len; p++)
+		*seq = *seq * 10 + (*p - '0');
+	return 0;
+}
+
+/*
+ * Clears the `n' (at least one) bits of a bitmap starting at bit `from', a
+ * word at a time.  The range must not run past the end of the bitmap.
+ */
+static void clear_bits(uint64_t *bits, uint64_t from, uint64_t n)
 {
-	delta_init(&msg_cache);
+	uint64_t first = from / 64, last = (from + n - 1) / 64;
+	uint64_t head = ~0ULL << (from % 64);
+	uint64_t tail = ~0ULL >> (63 - (from + n - 1) % 64);
+
+	if (first == last) {
+		bits[first] &= ~(head & tail);
+		return;
+	}
+	bits[first] &= ~head;
+	memset(&bits[first + 1], 0, (last - first - 1) * sizeof(uint64_t));
+	bits[last] &= ~tail;
 }
 
+/*
+ * Records `seq' in an origin's window, sliding it forward if `seq' is newer
+ * than any seen so far.  Returns 1 if `seq' was already recorded, 0 if not, or
+ * -1 if it is too old for the window.
+ */
+static int window_check(struct origin_window *w, uint64_t seq)
+{
+	uint64_t width = window_words * 64, bit, *word, from, n;
+
+	if (seq > w->top) {
+		/* clear the bits for top+1..seq, which may wrap around */
+		from = (w->top + 1) % width;
+		n = seq - w->top;
+		if (n >= width) {
+			memset(w->bits, 0, window_words * sizeof(uint64_t));
+		} else if (from + n > width) {
+			clear_bits(w->bits, from, width - from);
+			clear_bits(w->bits, 0, n - (width - from));
+		} else {
+			clear_bits(w->bits, from, n);
+		}
+		w->top = seq;
+	} else if (w->top - seq >= width) {
+		return -1;
+	}
+
+	bit = 1ULL << (seq % 64);
+	word = &w->bits[(seq / 64) % window_words];
+	if (*word & bit)
+		return 1;
+	*word |= bit;
+	return 0;
+}
+
+/*
+ * Checks a sequence-numbered ID against its origin's window.  Returns -1 if
+ * the ID must be checked against the cache proper instead.
+ */
+static int window_cache_msg(const char *id, size_t len)
+{
+	uint64_t buf[(sizeof(struct origin_window) / 8) + window_words];
+	struct origin_window *w = (struct origin_window*) buf;
+	struct msg_digest origin;
+	struct delta_stripe *s;
+	struct delta_node **link;
+	unsigned long hash;
+	size_t origin_len;
+	uint64_t seq;
+	int rc;
+
+	if (parse_seq_id(id, len, &origin_len, &seq))
+		return -1;
+
+	make_digest(&origin, id, origin_len);
+	hash = delta_mix_hash(digest_hash(&origin));
+	s = delta_stripe(&origin_cache, hash);
+
+	pthread_mutex_lock(&s->lock);
+	link = __delta_find(&origin_cache, s, &origin, hash, digest_equals);
+	if (link) {
+		rc = window_check((struct origin_window*) (*link)->key, seq);
+	} else {
+		w->origin = origin;
+		w->top = seq;
+		memset(w->bits, 0, window_words * sizeof(uint64_t));
+		rc = window_check(w, seq);
+	}
+	if (__delta_update_locked(&origin_cache, s, link, w, hash,
+				origin_cache.timeout_ms) < 0)
+		rc = -1;
+	pthread_mutex_unlock(&s->lock);
+
+#ifdef PSNETLOG
+	if (!rc)
+		printf(ANSI_GREEN "C %.*s\n" ANSI_RESET, (int) len, id);
+#endif
+	return rc;
+}
+
+/*
+ * Called when there is no memory to cache an ID.  The message is treated as
+ * new, so that it is flooded (perhaps more than once) rather than lost.
+ */
+static int not_cached(const char *id, size_t len)
+{
+	fprintf(stderr, "cache_msg: out of memory; %.*s not cached\n",
+			(int) len, id);
+	return 0;
+}
+
+/*
+ * Records the message ID `id' (of length `len').  Returns non-zero if it was
+ * already cached, in which case the message is a duplicate.
+ */
+int cache_msg(const char *id, size_t len)
+{
+	struct msg_digest digest;
+	struct msg_key key;
+	int rc;
+
+	if (window_words && (rc = window_cache_msg(id, len)) >= 0)
+		return rc;
+
+	if (string_keys) {
+		if (len >= MSG_ID_MAX) {
+			rc = cache_long_msg(id, len);
+			return rc < 0 ? not_cached(id, len) : rc;
+		}
+		memcpy(key.id, id, len);
+		key.id[len] = '\0';
+		rc = msg_delta_update(cache, &key);
+#ifdef PSNETLOG
+		if (!rc)
+			printf(ANSI_GREEN "C %s\n" ANSI_RESET, key.id);
+#endif
+		return rc < 0 ? not_cached(id, len) : rc;
+	}
+
+	make_digest(&digest, id, len);
+	if (bloom.enabled)
+		return bloom_cache_msg(&digest);
+
+	rc = msg_digest_update(cache, &digest);
+#ifdef PSNETLOG
+	if (!rc)
+		printf(ANSI_GREEN "C %.*s\n" ANSI_RESET, (int) len, id);
+#endif
+	return rc < 0 ? not_cached(id, len) : rc;
+}
+
+/*
+ * Sets up the cache.  In exact mode, if `lazy' is set, IDs are expired as
+ * they are looked up rather than by the timer service (see struct delta_list),
+ * and the cache is split into `shards' independently locked stripes.
+ */
+void msg_cache_init(const struct msg_cache_opts *opts)
+{
+	seed_digest();
+
+	if (opts->seq_window) {
+		window_words = (opts->seq_window + 63) / 64;
+		origin_cache.key_size = sizeof(struct origin_window) +
+			window_words * sizeof(uint64_t);
+		origin_cache.timeout_ms = opts->timeout_ms;
+		origin_cache.lazy = opts->lazy;
+		delta_init(&origin_cache);
+	}
+
+	if (opts->mode == MSG_CACHE_BLOOM) {
+		bloom_init(opts);
+		return;
+	}
+
+	if (opts->string_keys) {
+		string_keys = 1;
+		cache = &string_cache;
+		long_cache.timeout_ms = opts->timeout_ms;
+		long_cache.lazy = opts->lazy;
+		long_cache.nr_stripes = opts->shards;
+		delta_init(&long_cache);
+	}
+
+	cache->timeout_ms = opts->timeout_ms;
+	cache->lazy = opts->lazy;
+	cache->nr_stripes = opts->shards;
+	delta_init(cache);
+}
+
+/*
+ * Returns the number of IDs cached; in Bloom mode, the number added to the
+ * filters which have not yet been cleared.
+ */
 unsigned int msg_cache_size(void)
 {
-	return delta_size(&msg_cache);
+	unsigned long n = 0;
+
+	if (!bloom.enabled)
+		return delta_size(cache) +
+			(string_keys ? delta_size(&long_cache) : 0);
+
+	for (int g = 0; g < BLOOM_GENERATIONS; g++)
+		n += __atomic_load_n(&bloom.count[g], __ATOMIC_RELAXED);
+	return n;
+}
+
+/*
+ * Returns the number of origins with sequence windows.
+ */
+unsigned int msg_cache_origins(void)
+{
+	return window_words ? delta_size(&origin_cache) : 0;
+}
+
+/*
+ * Reports the allocators' statistics: for the cache proper in `keys', for the
+ * origin windows in `origins', and for long IDs in `long_ids'.  Long IDs are
+ * allocated individually from the heap, so only their count and allocations
+ * are reported.  Anything unused, such as every table in Bloom mode, reports
+ * zeros.
+ */
+void msg_cache_alloc_stats(struct slab_stats *keys, struct slab_stats *origins,
+		struct slab_stats *long_ids)
+{
+	memset(keys, 0, sizeof(*keys));
+	memset(origins, 0, sizeof(*origins));
+	memset(long_ids, 0, sizeof(*long_ids));
+	if (bloom.enabled)
+		return;
+
+	delta_alloc_stats(cache, keys);
+	if (window_words)
+		delta_alloc_stats(&origin_cache, origins);
+	if (string_keys) {
+		long_ids->in_use = delta_size(&long_cache);
+		long_ids->allocs = __atomic_load_n(&long_allocs,
+				__ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Snapshots: the cached keys and origin windows, each with the time it has
+ * left to live, written to a file which a restarted router reloads so that it
+ * does not flood messages it has already seen.  The file is a header followed
+ * by fixed-size records for the keys and windows, then variable-size records
+ * for any IDs too long for a key.  It is written through a shared mapping to
+ * a temporary file which then replaces the old one.  The digest seed is saved
+ * too, without which the saved digests would be meaningless.
+ */
+#define SNAPSHOT_MAGIC   0x434d5350 /* "PSMC" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_SLACK   64 /* extra records, for IDs cached while saving */
+
+struct snapshot_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seed[2];
+	uint64_t saved_ms;      /* wall clock time of the snapshot */
+	uint32_t key_size;      /* size of a cache key */
+	uint32_t nr_keys;
+	uint32_t window_size;   /* size of an origin window, or 0 */
+	uint32_t nr_windows;
+	uint32_t nr_long;       /* long IDs, in string mode */
+	uint32_t pad;
+};
+
+struct snapshot_rec {
+	uint32_t ttl_ms;
+	uint32_t len;           /* length of a long ID, otherwise 0 */
+	char key[];
+};
+
+struct snapshot_cursor {
+	char *pos;
+	char *end;              /* end of the space for long IDs */
+	size_t rec_size;
+	uint32_t nr;
+	uint32_t max;
+};
+
+static size_t rec_size(size_t key_size)
+{
+	return (sizeof(struct snapshot_rec) + key_size + 7) & ~(size_t) 7;
+}
+
+static uint64_t wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int save_rec(const data_t *it, unsigned int ttl_ms, void *arg)
+{
+	struct snapshot_cursor *c = arg;
+	struct snapshot_rec *rec = (struct snapshot_rec*) c->pos;
+
+	if (c->nr == c->max)
+		return 1;
+	rec->ttl_ms = ttl_ms;
+	rec->len = 0;
+	memcpy(rec->key, it, c->rec_size - sizeof(struct snapshot_rec));
+	c->pos += c->rec_size;
+	c->nr++;
+	return 0;
+}
+
+static int count_long(const data_t *it, unsigned int ttl_ms, void *arg)
+{
+	const struct long_id *l = it;
+
+	*(size_t*) arg += rec_size(l->len);
+	return 0;
+}
+
+static int save_long_rec(const data_t *it, unsigned int ttl_ms, void *arg)
+{
+	struct snapshot_cursor *c = arg;
+	struct snapshot_rec *rec = (struct snapshot_rec*) c->pos;
+	const struct long_id *l = it;
+
+	if (c->pos + rec_size(l->len) > c->end)
+		return 1;
+	rec->ttl_ms = ttl_ms;
+	rec->len = l->len;
+	memcpy(rec->key, l->id, l->len);
+	c->pos += rec_size(l->len);
+	c->nr++;
+	return 0;
+}
+
+/*
+ * Writes the cache's contents to `path'.  Returns 0 on success, or -1 on
+ * error.  Bloom mode is not saved.
+ */
+int msg_cache_save(const char *path)
+{
+	struct snapshot_hdr *hdr;
+	struct snapshot_cursor c;
+	size_t key_rec = rec_size(cache->key_size);
+	size_t win_rec = window_words ? rec_size(origin_cache.key_size) : 0;
+	uint32_t max_keys, max_windows;
+	char tmp[strlen(path) + 5];
+	size_t size, used, long_size = 0;
+	void *map;
+	int fd;
+
+	if (bloom.enabled)
+		return 0;
+
+	max_keys = delta_size(cache) + SNAPSHOT_SLACK;
+	max_windows = window_words ? msg_cache_origins() + SNAPSHOT_SLACK : 0;
+	if (string_keys) {
+		delta_foreach_ttl(&long_cache, count_long, &long_size);
+		long_size += SNAPSHOT_SLACK * rec_size(MSG_ID_MAX);
+	}
+	size = sizeof(*hdr) + max_keys * key_rec + max_windows * win_rec +
+		long_size;
+
+	sprintf(tmp, "%s.tmp", path);
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		perror(tmp);
+		return -1;
+	}
+	if (ftruncate(fd, size) == -1) {
+		perror("ftruncate");
+		goto err_close;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto err_close;
+	}
+
+	hdr = map;
+	hdr->magic = SNAPSHOT_MAGIC;
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->seed[0] = digest_seed[0];
+	hdr->seed[1] = digest_seed[1];
+	hdr->key_size = cache->key_size;
+	hdr->window_size = window_words ? origin_cache.key_size : 0;
+
+	c = (struct snapshot_cursor) { (char*) (hdr + 1), NULL, key_rec, 0,
+		max_keys };
+	delta_foreach_ttl(cache, save_rec, &c);
+	hdr->nr_keys = c.nr;
+
+	c = (struct snapshot_cursor) { c.pos, NULL, win_rec, 0, max_windows };
+	if (window_words)
+		delta_foreach_ttl(&origin_cache, save_rec, &c);
+	hdr->nr_windows = c.nr;
+
+	c = (struct snapshot_cursor) { c.pos, c.pos + long_size, 0, 0, 0 };
+	if (string_keys)
+		delta_foreach_ttl(&long_cache, save_long_rec, &c);
+	hdr->nr_long = c.nr;
+	hdr->saved_ms = wall_ms();
+
+	used = c.pos - (char*) map;
+	munmap(map, size);
+	if (ftruncate(fd, used) == -1 || fsync(fd) == -1) {
+		perror(tmp);
+		goto err_close;
+	}
+	close(fd);
+
+	if (rename(tmp, path) == -1) {
+		perror(path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+
+err_close:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/*
+ * Checks that `nr' records of `key_size'-byte keys fit between `*pos' and
+ * `end', and advances `*pos' past them.  If `strings' is set, each key must
+ * also be terminated within its `key_size' bytes.  Returns -1 if not.
+ */
+static int check_recs(const char **pos, const char *end, uint32_t nr,
+		size_t key_size, int strings)
+{
+	const struct snapshot_rec *r;
+	size_t rec = rec_size(key_size);
+
+	if (nr > (size_t) (end - *pos) / rec)
+		return -1;
+	for (uint32_t i = 0; strings && i < nr; i++) {
+		r = (const struct snapshot_rec*) (*pos + i * rec);
+		if (!memchr(r->key, '\0', key_size))
+			return -1;
+	}
+	*pos += nr * rec;
+	return 0;
+}
+
+/*
+ * Checks that `nr' long ID records fit between `pos' and `end'.  Returns -1
+ * if not.
+ */
+static int check_long_recs(const char *pos, const char *end, uint32_t nr)
+{
+	const struct snapshot_rec *rec;
+
+	for (uint32_t i = 0; i < nr; i++, pos += rec_size(rec->len)) {
+		rec = (const struct snapshot_rec*) pos;
+		if ((size_t) (end - pos) < sizeof(*rec) ||
+				rec->len < MSG_ID_MAX ||
+				(size_t) (end - pos) < rec_size(rec->len))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Inserts `nr' records of `key_size'-byte keys into `table', less the time
+ * `elapsed' since they were saved.  Returns a pointer past the last record.
+ */
+static const char *load_recs(struct delta_list *table, const char *pos,
+		uint32_t nr, size_t key_size, uint64_t elapsed)
+{
+	const struct snapshot_rec *rec;
+
+	for (uint32_t i = 0; i < nr; i++, pos += rec_size(key_size)) {
+		rec = (const struct snapshot_rec*) pos;
+		if (rec->ttl_ms <= elapsed)
+			continue;
+		delta_update_timeout(table, rec->key,
+				rec->ttl_ms - elapsed < table->timeout_ms ?
+				rec->ttl_ms - elapsed : table->timeout_ms);
+	}
+	return pos;
+}
+
+/*
+ * Inserts `nr' long ID records, as load_recs().
+ */
+static void load_long_recs(const char *pos, uint32_t nr, uint64_t elapsed)
+{
+	const struct snapshot_rec *rec;
+
+	for (uint32_t i = 0; i < nr; i++, pos += rec_size(rec->len)) {
+		rec = (const struct snapshot_rec*) pos;
+		if (rec->ttl_ms <= elapsed)
+			continue;
+		cache_long_id(rec->key, rec->len,
+				rec->ttl_ms - elapsed < long_cache.timeout_ms ?
+				rec->ttl_ms - elapsed : long_cache.timeout_ms);
+	}
+}
+
+/*
+ * Reloads a snapshot written by msg_cache_save().  Must be called after
+ * msg_cache_init() and before any IDs are cached.  A missing file, or one
+ * written with a different cache configuration, is ignored.  The whole file
+ * is checked before anything is inserted, so a corrupt snapshot leaves the
+ * cache empty; an ID which cannot be allocated is skipped.  Returns the number
+ * of records read, or -1 if the snapshot could not be used.
+ */
+int msg_cache_load(const char *path)
+{
+	const struct snapshot_hdr *hdr;
+	const char *pos, *end;
+	struct stat st;
+	uint64_t elapsed, now;
+	void *map;
+	int fd, rc = -1;
+
+	if (bloom.enabled)
+		return -1;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s: invalid snapshot\n", path);
+		goto out_close;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto out_close;
+	}
+
+	hdr = map;
+	if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "%s: invalid snapshot\n", path);
+		goto out_unmap;
+	}
+	if (hdr->key_size != cache->key_size || hdr->window_size !=
+			(window_words ? origin_cache.key_size : 0)) {
+		fprintf(stderr, "%s: cache configuration changed; snapshot "
+				"ignored\n", path);
+		goto out_unmap;
+	}
+
+	/* the sizes are now known to be sane, so nothing below can overflow */
+	pos = (const char*) (hdr + 1);
+	end = (const char*) map + st.st_size;
+	if (check_recs(&pos, end, hdr->nr_keys, hdr->key_size, string_keys) ||
+			(!window_words && hdr->nr_windows) ||
+			check_recs(&pos, end, hdr->nr_windows, hdr->window_size,
+				0) ||
+			(!string_keys && hdr->nr_long) ||
+			check_long_recs(pos, end, hdr->nr_long)) {
+		fprintf(stderr, "%s: invalid snapshot\n", path);
+		goto out_unmap;
+	}
+
+	now = wall_ms();
+	elapsed = now > hdr->saved_ms ? now - hdr->saved_ms : 0;
+	digest_seed[0] = hdr->seed[0];
+	digest_seed[1] = hdr->seed[1];
+
+	pos = load_recs(cache, (const char*) (hdr + 1), hdr->nr_keys,
+			hdr->key_size, elapsed);
+	pos = load_recs(&origin_cache, pos, hdr->nr_windows,
+			hdr->window_size, elapsed);
+	load_long_recs(pos, hdr->nr_long, elapsed);
+	rc = hdr->nr_keys + hdr->nr_windows + hdr->nr_long;
+
+out_unmap:
+	munmap(map, st.st_size);
+out_close:
+	close(fd);
+	return rc;
 }
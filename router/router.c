@@ -18,7 +18,6 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -26,6 +25,7 @@
 #include "client.h"
 #include "network.h"
 #include "protocol.h"
+#include "timer.h"
 
 #include "router.h"
 
@@ -34,11 +34,24 @@
 static LIST_HEAD(routers);
 static pthread_mutex_t routers_lock;
 
+/* datagrams forwarded, and forwards which failed */
+static unsigned long flood_sent;
+static unsigned long flood_failed;
+
 struct tracker_arg {
 	PSNET *tracker;
 	in_port_t port;
 };
 
+/*
+ * The router list is fetched over TCP, which can block for seconds if the
+ * tracker is slow or down, so it is done by its own thread rather than on the
+ * shared timer thread.  The timer only wakes it.
+ */
+static pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t update_cond = PTHREAD_COND_INITIALIZER;
+static int update_due;
+
 static void set_routers(struct list_head *new)
 {
 	struct list_head *pos, *n;
@@ -71,45 +84,65 @@ static void print_routers(struct list_head *head)
 	}
 }
 
-static _Noreturn void *router_update_thread(void *data)
+/*
+ * Replaces the router list with a fresh one from the tracker.  Returns the
+ * number of milliseconds until the next update.
+ */
+static unsigned int router_update(struct tracker_arg *a)
 {
 	struct list_head tmp;
-	struct tracker_arg *a = data;
 
-	pthread_detach(pthread_self());
-
-	for(;;) {
-		INIT_LIST_HEAD(&tmp);
-		for (;;) {
-			pthread_mutex_lock(&routers_lock);
-			if (!psnet_request_discover(a->tracker, &tmp, OUTDEGREE,
-					a->port))
-			break;
-			fprintf(stderr, "get_list: failed to update router list\n");
-			pthread_mutex_unlock(&routers_lock);
-			sleep(DIR_RETRY_INTERVAL);
-		}
-
-		set_routers(&tmp);
+	INIT_LIST_HEAD(&tmp);
+	if (psnet_request_discover(a->tracker, &tmp, OUTDEGREE, a->port)) {
+		fprintf(stderr, "get_list: failed to update router list\n");
+		return DIR_RETRY_INTERVAL * 1000;
+	}
+
+	pthread_mutex_lock(&routers_lock);
+	set_routers(&tmp);
 #ifdef PSNETLOG
-		print_routers(&routers);
+	print_routers(&routers);
 #endif
-		pthread_mutex_unlock(&routers_lock);
-		sleep(ROUTERS_UPDATE_INTERVAL);
+	pthread_mutex_unlock(&routers_lock);
+	return ROUTERS_UPDATE_INTERVAL * 1000;
+}
+
+/*
+ * Timer callback: wakes the update thread.  The thread schedules the next
+ * wake-up itself once the update is done.
+ */
+static unsigned int router_update_wake(void *data)
+{
+	pthread_mutex_lock(&update_lock);
+	update_due = 1;
+	pthread_cond_signal(&update_cond);
+	pthread_mutex_unlock(&update_lock);
+	return 0;
+}
+
+static _Noreturn void *router_update_thread(void *data)
+{
+	for (;;) {
+		pthread_mutex_lock(&update_lock);
+		while (!update_due)
+			pthread_cond_wait(&update_cond, &update_lock);
+		update_due = 0;
+		pthread_mutex_unlock(&update_lock);
+
+		timer_schedule(router_update(data), router_update_wake, data);
 	}
 }
 
-static _Noreturn void *router_keepalive_thread(void *data)
+/*
+ * Timer callback: tells the tracker that this router is still alive.
+ */
+static unsigned int router_keepalive(void *data)
 {
 	struct tracker_arg *a = data;
 
-	pthread_detach(pthread_self());
-
-	for(;;) {
-		if (psnet_send_connect(a->tracker, a->port) == -1)
-			fprintf(stderr, "send_connect: failed to update tracker\n");
-		sleep(DIR_KEEPALIVE_INTERVAL);
-	}
+	if (psnet_send_connect(a->tracker, a->port) == -1)
+		fprintf(stderr, "send_connect: failed to update tracker\n");
+	return DIR_KEEPALIVE_INTERVAL * 1000;
 }
 
 int router_init(char *tracker_addr, char *tracker_port, char *listen_port)
@@ -132,32 +165,47 @@ int router_init(char *tracker_addr, char *tracker_port, char *listen_port)
 	arg->port = port;
 
 	pthread_mutex_init(&routers_lock, NULL);
-	if (pthread_create(&tid, NULL, router_update_thread, arg))
-		perror("pthread_create");
-	if (pthread_create(&tid, NULL, router_keepalive_thread, arg))
+	update_due = 1;
+	if (pthread_create(&tid, NULL, router_update_thread, arg)) {
 		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(tid);
+	timer_schedule(0, router_keepalive, arg);
 
 	return 0;
 }
 
 void flood_message(struct msg_info *mi)
 {
+	struct udp_fanout fanout;
 	struct list_head *it;
 
-	pthread_mutex_lock(&routers_lock);
+	udp_fanout_init(&fanout, mi->msg, mi->len);
 
 	// send message to routers
+	pthread_mutex_lock(&routers_lock);
 	list_for_each(it, &routers) {
 		struct sockaddr *addr = psnet_list_entry_addr(it);
 		if (ip_addr_equals(addr,(struct sockaddr*)&mi->addr))
 			continue;
-		udp_send(addr, mi->len, mi->msg);
+		udp_fanout_add(&fanout, addr);
 	}
+	pthread_mutex_unlock(&routers_lock);
 
 	// send message to clients
-	flood_to_clients(mi);
+	flood_to_clients(&fanout);
 
-	pthread_mutex_unlock(&routers_lock);
+	udp_fanout_send(&fanout);
+	__atomic_add_fetch(&flood_sent, fanout.sent, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&flood_failed, fanout.failed, __ATOMIC_RELAXED);
+	udp_fanout_free(&fanout);
+}
+
+void flood_stats(unsigned long *sent, unsigned long *failed)
+{
+	*sent = __atomic_load_n(&flood_sent, __ATOMIC_RELAXED);
+	*failed = __atomic_load_n(&flood_failed, __ATOMIC_RELAXED);
 }
 
 void routers_to_json(struct list_head *head, int n)
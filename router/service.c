@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -32,13 +34,16 @@
 #include "jsmn.h"
 
 #include "client.h"
+#include "deltalist.h"
 #include "misc.h"
 #include "msgcache.h"
+#include "msgpool.h"
 #include "network.h"
 #include "parse.h"
 #include "protocol.h"
 #include "router.h"
 #include "server.h"
+#include "slab.h"
 
 #define RC_FILE "/etc/psnetrc"
 
@@ -52,11 +57,19 @@ static struct settings {
 	char *dir_addr;
 	char *dir_port;
 	char *listen_port;
+	unsigned int client_timeout;
+	struct msg_cache_opts cache;
+	char *snapshot;                 /* message cache snapshot file */
+	unsigned int snapshot_interval; /* seconds between snapshots, or 0 */
+	struct server_opts server;
 } settings = {
 	.max_threads = 1000,
 	.dir_addr = "psnet.no-ip.biz",
 	.dir_port = "6666",
 	.listen_port = "5555",
+	.client_timeout = CLIENT_TIMEOUT,
+	.cache = MSG_CACHE_OPTS_INIT,
+	.server = SERVER_OPTS_INIT
 };
 
 #define node_error(sock, no) psnet_send_error(sock, no, psnode_strerror[no])
@@ -68,9 +81,6 @@ static const char *psnode_strerror[] = {
 	[EBADNUM]    = "invalid argument 'num'"
 };
 
-int num_threads;
-pthread_mutex_t num_threads_lock;
-
 static void process_ip(struct msg_info *mi, jsmntok_t *tok, size_t ntok)
 {
 	char addr[INET6_ADDRSTRLEN];
@@ -83,23 +93,42 @@ static void process_ip(struct msg_info *mi, jsmntok_t *tok, size_t ntok)
 	rsp_len = sprintf(rsp, "{\"ip\":\"%s\"}\r\n\r\n", addr);
 	hdr_len = sprintf(hdr, HDR_OK_FMT, rsp_len);
 
-	tcp_send_bytes(mi->sock, hdr, hdr_len);
-	tcp_send_bytes(mi->sock, rsp, rsp_len);
+	tcp_send_iov(mi->sock, (struct iovec[]) {
+			{ hdr, hdr_len }, { rsp, rsp_len } }, 2);
 }
 
 static void process_info(struct msg_info *mi, jsmntok_t *tok, size_t ntok)
 {
+	unsigned long sent, failed;
+	struct slab_stats client_alloc, cache_alloc, origin_alloc, long_alloc;
 	char hdr[HDR_OK_STRLEN];
-	char rsp[60 + 10 + 10]; /* 20 digits for clients and cache-load */
+	char stats[SERVER_STATS_STRLEN];
+	char rsp[184 + 10 + 10 + 10 + 20 + 20 + 4 * SLAB_STATS_STRLEN +
+		SERVER_STATS_STRLEN];
 	int hdr_len, rsp_len;
 
-	rsp_len = sprintf(rsp, "{\"name\":\"generic psnet router\","
-			"\"clients\":%d,\"cache-load\":%d}\r\n\r\n",
-			client_list_size(), msg_cache_size());
+	flood_stats(&sent, &failed);
+	client_alloc_stats(&client_alloc);
+	msg_cache_alloc_stats(&cache_alloc, &origin_alloc, &long_alloc);
+	server_stats_json(stats, sizeof stats);
+	rsp_len = snprintf(rsp, sizeof rsp, "{\"name\":\"generic psnet "
+			"router\",\"clients\":%d,\"cache-load\":%d,"
+			"\"cache-origins\":%u,"
+			"\"flood-sent\":%lu,\"flood-failed\":%lu,"
+			"\"client-alloc\":" SLAB_STATS_FMT ","
+			"\"cache-alloc\":" SLAB_STATS_FMT ","
+			"\"origin-alloc\":" SLAB_STATS_FMT ","
+			"\"long-id-alloc\":" SLAB_STATS_FMT ",%s}\r\n\r\n",
+			client_list_size(), msg_cache_size(),
+			msg_cache_origins(), sent, failed,
+			SLAB_STATS_ARGS(client_alloc),
+			SLAB_STATS_ARGS(cache_alloc),
+			SLAB_STATS_ARGS(origin_alloc),
+			SLAB_STATS_ARGS(long_alloc), stats);
 	hdr_len = sprintf(hdr, HDR_OK_FMT, rsp_len);
 
-	tcp_send_bytes(mi->sock, hdr, hdr_len);
-	tcp_send_bytes(mi->sock, rsp, rsp_len);
+	tcp_send_iov(mi->sock, (struct iovec[]) {
+			{ hdr, hdr_len }, { rsp, rsp_len } }, 2);
 }
 
 static void process_ping(struct msg_info *mi, jsmntok_t *tok, int ntok)
@@ -121,7 +150,7 @@ static void process_connect(struct msg_info *mi, jsmntok_t *tok, int ntok)
 
 	mi->msg[tok[port].end] = '\0';
 
-	if(add_client(&mi->addr, mi->msg + tok[port].start))
+	if(queue_client(&mi->addr, mi->msg + tok[port].start))
 		return;
 
 #ifdef PSNETLOG
@@ -151,16 +180,15 @@ static void process_broadcast(struct msg_info *mi, jsmntok_t *tok, int ntok)
 		return; // hop limit reached
 	msg[tok[hops].start]++;
 
-	msgid = jsmn_tokdup(msg, &tok[id]);
-	if (cache_msg(msgid)) {
-		free(msgid);
+	msgid = msg + tok[id].start;
+	if (cache_msg(msgid, jsmn_toklen(&tok[id])))
 		return;
-	}
 
 	flood_message(mi);
 
 #ifdef PSNETLOG
-	printf(ANSI_YELLOW "F %s\n" ANSI_RESET, msgid);
+	printf(ANSI_YELLOW "F %.*s\n" ANSI_RESET, jsmn_toklen(&tok[id]),
+			msgid);
 #endif
 }
 
@@ -191,60 +219,42 @@ static void process_discover(struct msg_info *mi, jsmntok_t *tok, int ntok)
 }
 
 /*
- * Handles a TCP connection (callback for tcp_server_main())
+ * Dispatches a single request read from a TCP connection.  Returns non-zero if
+ * the connection should be closed.
  */
-static void *handle_connection(void *data)
+static int dispatch_request(struct msg_info *mi)
 {
-	struct msg_info *mi = data;
 	jsmntok_t tok[JSMN_NTOK];
 	size_t ntok = JSMN_NTOK;
 	int method;
 
-	for(;;) {
-
-		if (tcp_read_msg(mi->sock, mi->msg, MSG_MAX) <= 0)
-			break; /* connection closed by client */
-
-		/* dispatch */
-		#define cmd_equal(cmd) jsmn_tokeq(mi->msg, &tok[method], cmd)
-		if ((method = parse_message(mi->msg, tok, &ntok)) == -1) {
-			node_error(mi->sock, ENOMETHOD);
-			break;
-		} else if (cmd_equal("broadcast")) {
-			process_broadcast(mi, tok, ntok);
-		} else if (cmd_equal("ip")) {
-			process_ip(mi, tok, ntok);
-		} else if (cmd_equal("info")) {
-			process_info(mi, tok, ntok);
-		} else if (cmd_equal("ping")) {
-			process_ping(mi, tok, ntok);
-		} else if (cmd_equal("discover")) {
-			process_discover(mi, tok, ntok);
-		} else {
-			node_error(mi->sock, EBADMETHOD);
-			break;
-		}
-		#undef cmd_equal
+	#define cmd_equal(cmd) jsmn_tokeq(mi->msg, &tok[method], cmd)
+	if ((method = parse_message(mi->msg, tok, &ntok)) == -1) {
+		node_error(mi->sock, ENOMETHOD);
+		return -1;
+	} else if (cmd_equal("broadcast")) {
+		process_broadcast(mi, tok, ntok);
+	} else if (cmd_equal("ip")) {
+		process_ip(mi, tok, ntok);
+	} else if (cmd_equal("info")) {
+		process_info(mi, tok, ntok);
+	} else if (cmd_equal("ping")) {
+		process_ping(mi, tok, ntok);
+	} else if (cmd_equal("discover")) {
+		process_discover(mi, tok, ntok);
+	} else {
+		node_error(mi->sock, EBADMETHOD);
+		return -1;
 	}
-
-	/* clean up */
-	close(mi->sock);
-	pthread_mutex_lock(&num_threads_lock);
-	num_threads--;
-	pthread_mutex_unlock(&num_threads_lock);
-#ifdef PSNETLOG
-	printf("D %s\n", mi->paddr);
-#endif
-	free(mi);
-	pthread_exit(NULL);
+	#undef cmd_equal
+	return 0;
 }
 
 /*
  * Handles a UDP message (callback for udp_server_main())
  */
-static void *handle_message(void *data)
+static void handle_message(struct msg_info *mi)
 {
-	struct msg_info *mi = data;
 	jsmntok_t tok[JSMN_NTOK];
 	size_t ntok = JSMN_NTOK;
 	int method;
@@ -252,22 +262,16 @@ static void *handle_message(void *data)
 	/* dispatch */
 	#define cmd_equal(cmd) jsmn_tokeq(mi->msg, &tok[method], cmd)
 	if ((method = parse_message(mi->msg, tok, &ntok)) == -1)
-		goto cleanup;
+		return;
 	else if (cmd_equal("connect"))
 		process_connect(mi, tok, ntok);
 	else if (cmd_equal("broadcast"))
 		process_broadcast(mi, tok, ntok);
 	#undef cmd_equal
 
-cleanup:
-	pthread_mutex_lock(&num_threads_lock);
-	num_threads--;
-	pthread_mutex_unlock(&num_threads_lock);
-	free(mi);
 #ifdef PSNETLOG
 	printf("-M %s\n", mi->paddr);
 #endif
-	pthread_exit(NULL);
 }
 
 static _Noreturn void usage(void)
@@ -279,13 +283,12 @@ static _Noreturn void usage(void)
 
 static void *udp_serve(void *data)
 {
-	int sockfd;
+	struct settings *settings = data;
 
 	pthread_detach(pthread_self());
 
-	sockfd = udp_server_init(((struct settings*)data)->listen_port);
-	udp_server_main(sockfd,((struct settings*)data)->max_threads,
-			handle_message);
+	udp_server_main(settings->listen_port, &settings->server, handle_message,
+			flush_clients);
 }
 
 static int ini_handler(void *user, const char *section, const char *name,
@@ -296,6 +299,9 @@ static int ini_handler(void *user, const char *section, const char *name,
 	if (strcmp(section, "Router"))
 		return 1;
 
+	if (server_ini_handler(&settings.server, user, name, value))
+		return 1;
+
 	if (!strcmp(name, "directory-address")) {
 		settings.dir_addr = strdup(value);
 	} else if (!strcmp(name, "directory-port")) {
@@ -319,6 +325,83 @@ static int ini_handler(void *user, const char *section, const char *name,
 		} else {
 			settings.max_threads = val;
 		}
+	} else if (!strcmp(name, "client-timeout")) {
+		if ((val = atoi(value)) < 1) {
+			printf("%s: error: client-timeout must be a positive integer\n",
+				(char*) user);
+		} else {
+			settings.client_timeout = val;
+		}
+	} else if (!strcmp(name, "cache-timeout")) {
+		if ((val = atoi(value)) < 1) {
+			printf("%s: error: cache-timeout must be a positive integer\n",
+				(char*) user);
+		} else {
+			settings.cache.timeout_ms = val;
+		}
+	} else if (!strcmp(name, "cache-shards")) {
+		if ((val = atoi(value)) < 1 || val > DELTA_MAX_STRIPES) {
+			printf("%s: error: cache-shards must be between 1 and "
+					"%d\n", (char*) user, DELTA_MAX_STRIPES);
+		} else {
+			settings.cache.shards = val;
+		}
+	} else if (!strcmp(name, "cache-mode")) {
+		if (!strcmp(value, "exact"))
+			settings.cache.mode = MSG_CACHE_EXACT;
+		else if (!strcmp(value, "bloom"))
+			settings.cache.mode = MSG_CACHE_BLOOM;
+		else
+			printf("%s: error: cache-mode must be 'exact' or "
+					"'bloom'\n", (char*) user);
+	} else if (!strcmp(name, "cache-capacity")) {
+		if ((val = atoi(value)) < 1) {
+			printf("%s: error: cache-capacity must be a positive "
+					"integer\n", (char*) user);
+		} else {
+			settings.cache.capacity = val;
+		}
+	} else if (!strcmp(name, "cache-fp-rate")) {
+		double rate = strtod(value, NULL);
+		if (rate <= 0 || rate >= 1) {
+			printf("%s: error: cache-fp-rate must be between 0 and "
+					"1\n", (char*) user);
+		} else {
+			settings.cache.fp_rate = rate;
+		}
+	} else if (!strcmp(name, "cache-snapshot")) {
+		settings.snapshot = strdup(value);
+	} else if (!strcmp(name, "cache-snapshot-interval")) {
+		if ((val = atoi(value)) < 0) {
+			printf("%s: error: cache-snapshot-interval must be a "
+					"non-negative integer\n", (char*) user);
+		} else {
+			settings.snapshot_interval = val;
+		}
+	} else if (!strcmp(name, "cache-sequence-window")) {
+		if ((val = atoi(value)) < 0 || val > MSG_SEQ_WINDOW_MAX) {
+			printf("%s: error: cache-sequence-window must be between "
+					"0 and %d\n", (char*) user,
+					MSG_SEQ_WINDOW_MAX);
+		} else {
+			settings.cache.seq_window = val;
+		}
+	} else if (!strcmp(name, "cache-keys")) {
+		if (!strcmp(value, "digest"))
+			settings.cache.string_keys = 0;
+		else if (!strcmp(value, "string"))
+			settings.cache.string_keys = 1;
+		else
+			printf("%s: error: cache-keys must be 'digest' or "
+					"'string'\n", (char*) user);
+	} else if (!strcmp(name, "cache-expiry")) {
+		if (!strcmp(value, "lazy"))
+			settings.cache.lazy = 1;
+		else if (!strcmp(value, "timer"))
+			settings.cache.lazy = 0;
+		else
+			printf("%s: error: cache-expiry must be 'lazy' or "
+					"'timer'\n", (char*) user);
 	}
 	return 1;
 }
@@ -389,9 +472,37 @@ void parse_opts(int argc, char *argv[], struct settings *dst)
 	}
 }
 
+/*
+ * Saves the message cache every snapshot_interval seconds, and on SIGTERM or
+ * SIGINT, after which it exits.  The signals must be blocked in every thread.
+ */
+static _Noreturn void *snapshot_thread(void *data)
+{
+	const sigset_t *sigs = data;
+	struct timespec interval = { .tv_sec = settings.snapshot_interval };
+	int sig;
+
+	for (;;) {
+		if (settings.snapshot_interval)
+			sig = sigtimedwait(sigs, NULL, &interval);
+		else
+			sig = sigwaitinfo(sigs, NULL);
+
+		if (sig == -1 && errno == EINTR)
+			continue;
+		if (sig == -1 && errno != EAGAIN)
+			perror("sigwait");
+
+		if (msg_cache_save(settings.snapshot))
+			fprintf(stderr, "failed to save message cache\n");
+		if (sig != -1)
+			exit(EXIT_SUCCESS);
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	int sockfd;
+	static sigset_t sigs;
 	pthread_t tid;
 
 	if (ini_parse(RC_FILE, ini_handler, RC_FILE))
@@ -402,16 +513,30 @@ int main(int argc, char *argv[])
 	daemonize();
 #endif
 
-	num_threads = 0;
-	pthread_mutex_init(&num_threads_lock, NULL);
+	if (settings.snapshot) {
+		/* before any thread is created, so that all inherit the mask */
+		sigemptyset(&sigs);
+		sigaddset(&sigs, SIGTERM);
+		sigaddset(&sigs, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	}
+
+	udp_send_set_buffer(settings.server.send_buffer);
+	msgpool_init(settings.server.msg_pool_size);
+	clients_init(settings.client_timeout);
+	msg_cache_init(&settings.cache);
+
+	if (settings.snapshot) {
+		msg_cache_load(settings.snapshot);
+		if (pthread_create(&tid, NULL, snapshot_thread, &sigs))
+			perror("pthread_create");
+	}
 
-	clients_init();
-	msg_cache_init();
 	router_init(settings.dir_addr, settings.dir_port, settings.listen_port);
 
 	if (pthread_create(&tid, NULL, udp_serve, &settings))
 		perror("pthread_create");
 
-	sockfd = tcp_server_init(settings.listen_port);
-	tcp_server_main(sockfd, settings.max_threads, handle_connection);
+	tcp_server_main(settings.listen_port, &settings.server, settings.max_threads,
+			dispatch_request);
 }
@@ -34,10 +34,12 @@
 
 #include "client.h"
 #include "misc.h"
+#include "msgpool.h"
 #include "network.h"
 #include "parse.h"
 #include "protocol.h"
 #include "server.h"
+#include "slab.h"
 
 #define RC_FILE "/etc/psnetrc"
 
@@ -55,29 +57,36 @@ static const char *psdir_strerror[] = {
 	[EBADPORT]   = "invalid argument 'port'"
 };
 
-int num_threads;
-pthread_mutex_t num_threads_lock;
-
 static struct settings {
 	int max_threads;
 	char *port;
+	unsigned int client_timeout;
+	struct server_opts server;
 } settings = {
 	.max_threads = 1000,
-	.port = "6666"
+	.port = "6666",
+	.client_timeout = CLIENT_TIMEOUT,
+	.server = SERVER_OPTS_INIT
 };
 
 static void process_info(struct msg_info *mi, jsmntok_t *tok, size_t ntok)
 {
+	struct slab_stats alloc;
 	char hdr[HDR_OK_STRLEN];
-	char rsp[47 + 10]; /* space for 10-digit router count */
+	char stats[SERVER_STATS_STRLEN];
+	char rsp[64 + 10 + SLAB_STATS_STRLEN + SERVER_STATS_STRLEN];
 	int hdr_len, rsp_len;
 
-	rsp_len = sprintf(rsp, "{\"name\":\"generic psnet tracker\","
-			"\"routers\":%d}\r\n\r\n", client_list_size());
+	client_alloc_stats(&alloc);
+	server_stats_json(stats, sizeof stats);
+	rsp_len = snprintf(rsp, sizeof rsp, "{\"name\":\"generic psnet "
+			"tracker\",\"routers\":%d,\"client-alloc\":"
+			SLAB_STATS_FMT ",%s}\r\n\r\n", client_list_size(),
+			SLAB_STATS_ARGS(alloc), stats);
 	hdr_len = sprintf(hdr, HDR_OK_FMT, rsp_len);
 
-	tcp_send_bytes(mi->sock, hdr, hdr_len);
-	tcp_send_bytes(mi->sock, rsp, rsp_len);
+	tcp_send_iov(mi->sock, (struct iovec[]) {
+			{ hdr, hdr_len }, { rsp, rsp_len } }, 2);
 }
 
 /*
@@ -93,7 +102,7 @@ static void process_connect(struct msg_info *mi, jsmntok_t *tok, int ntok)
 
 	mi->msg[tok[port].end] = '\0';
 
-	if (add_client(&mi->addr, mi->msg + tok[port].start))
+	if (queue_client(&mi->addr, mi->msg + tok[port].start))
 		return;
 
 #ifdef PSNETLOG
@@ -197,56 +206,38 @@ static void process_discover(struct msg_info *mi, jsmntok_t *tok, int ntok)
 }
 
 /*
- * Handles a TCP connection (callback for tcp_server_main())
+ * Dispatches a single request read from a TCP connection.  Returns non-zero if
+ * the connection should be closed.
  */
-static void *handle_connection(void *data)
+static int dispatch_request(struct msg_info *mi)
 {
-	struct msg_info *mi = data;
 	jsmntok_t tok[JSMN_NTOK];
 	size_t ntok = JSMN_NTOK;
 	int method;
 
-	for(;;) {
-
-		if (tcp_read_msg(mi->sock, mi->msg, MSG_MAX) <= 0)
-			break; /* connection closed by client */
-
-		/* dispatch */
-		#define cmd_equal(cmd) jsmn_tokeq(mi->msg, &tok[method], cmd)
-		if ((method = parse_message(mi->msg, tok, &ntok)) == -1) {
-			dir_error(mi->sock, ENOMETHOD);
-			break;
-		} else if (cmd_equal("list")) {
-			process_list(mi, tok, ntok);
-		} else if (cmd_equal("discover")) {
-			process_discover(mi, tok, ntok);
-		} else if (cmd_equal("info")) {
-			process_info(mi, tok, ntok);
-		} else {
-			dir_error(mi->sock, EBADMETHOD);
-			break;
-		}
-		#undef cmd_equal
+	#define cmd_equal(cmd) jsmn_tokeq(mi->msg, &tok[method], cmd)
+	if ((method = parse_message(mi->msg, tok, &ntok)) == -1) {
+		dir_error(mi->sock, ENOMETHOD);
+		return -1;
+	} else if (cmd_equal("list")) {
+		process_list(mi, tok, ntok);
+	} else if (cmd_equal("discover")) {
+		process_discover(mi, tok, ntok);
+	} else if (cmd_equal("info")) {
+		process_info(mi, tok, ntok);
+	} else {
+		dir_error(mi->sock, EBADMETHOD);
+		return -1;
 	}
-
-	/* clean up */
-	close(mi->sock);
-	pthread_mutex_lock(&num_threads_lock);
-	num_threads--;
-	pthread_mutex_unlock(&num_threads_lock);
-#ifdef PSNETLOG
-	printf("D %s\n", mi->paddr);
-#endif
-	free(mi);
-	pthread_exit(NULL);
+	#undef cmd_equal
+	return 0;
 }
 
 /*
  * Handles a UDP message (callback for udp_server_main())
  */
-static void *handle_message(void *data)
+static void handle_message(struct msg_info *mi)
 {
-	struct msg_info *mi = data;
 	jsmntok_t tok[JSMN_NTOK];
 	size_t ntok = JSMN_NTOK;
 	int method;
@@ -254,22 +245,16 @@ static void *handle_message(void *data)
 	/* dispatch */
 	#define cmd_equal(cmd) jsmn_tokeq(mi->msg, &tok[method], cmd)
 	if ((method = parse_message(mi->msg, tok, &ntok)) == -1)
-		goto cleanup;
+		return;
 	else if (cmd_equal("connect"))
 		process_connect(mi, tok, ntok);
 	else if (cmd_equal("disconnect"))
 		process_disconnect(mi, tok, ntok);
 	#undef cmd_equal
 
-cleanup:
-	pthread_mutex_lock(&num_threads_lock);
-	num_threads--;
-	pthread_mutex_unlock(&num_threads_lock);
-	free(mi);
 #ifdef PSNETLOG
 	printf("-M %s\n", mi->paddr);
 #endif
-	pthread_exit(NULL);
 }
 
 static _Noreturn void usage(void)
@@ -282,13 +267,12 @@ static _Noreturn void usage(void)
 
 void *udp_serve(void *data)
 {
-	int sockfd;
+	struct settings *settings = data;
 
 	pthread_detach(pthread_self());
 
-	sockfd = udp_server_init(((struct settings*)data)->port);
-	udp_server_main(sockfd,((struct settings*)data)->max_threads,
-			handle_message);
+	udp_server_main(settings->port, &settings->server, handle_message,
+			flush_clients);
 }
 
 static int ini_handler(void *user, const char *section, const char *name,
@@ -299,6 +283,9 @@ static int ini_handler(void *user, const char *section, const char *name,
 	if (strcmp(section, "Tracker"))
 		return 1;
 
+	if (server_ini_handler(&settings.server, user, name, value))
+		return 1;
+
 	if (!strcmp(name, "listen-port")) {
 		if (!(val = atoi(value)))
 			printf("%s: error: listen-port must be "
@@ -313,6 +300,13 @@ static int ini_handler(void *user, const char *section, const char *name,
 					(char*) user);
 		else
 			settings.max_threads = val;
+	} else if (!strcmp(name, "client-timeout")) {
+		if ((val = atoi(value)) < 1)
+			printf("%s: error: client-timeout must be "
+					"a positive integer\n",
+					(char*) user);
+		else
+			settings.client_timeout = val;
 	}
 	return 1;
 }
@@ -371,7 +365,6 @@ void parse_opts(int argc, char *argv[], struct settings *dst)
 
 int main(int argc, char *argv[])
 {
-	int sockfd;
 	pthread_t tid;
 
 	if (ini_parse(RC_FILE, ini_handler, RC_FILE))
@@ -382,14 +375,13 @@ int main(int argc, char *argv[])
 	daemonize();
 #endif
 
-	num_threads = 0;
-	pthread_mutex_init(&num_threads_lock, NULL);
-
-	clients_init();
+	udp_send_set_buffer(settings.server.send_buffer);
+	msgpool_init(settings.server.msg_pool_size);
+	clients_init(settings.client_timeout);
 
 	if (pthread_create(&tid, NULL, udp_serve, &settings))
 		perror("pthread_create");
 
-	sockfd = tcp_server_init(settings.port);
-	tcp_server_main(sockfd, settings.max_threads, handle_connection);
+	tcp_server_main(settings.port, &settings.server, settings.max_threads,
+			dispatch_request);
 }